@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/gameboy.h"
+
+static char *name;
+
+struct InputEvent
+{
+  unsigned long frame;
+  Joypad::Button::Name button;
+  bool pressed;
+};
+
+struct Job
+{
+  std::string rom_file;
+  unsigned long frames;
+
+  // Mapped once and shared by every job running the same ROM
+  std::shared_ptr<const RomImage> rom;
+
+  // Sorted by frame, each applied before that frame is emulated
+  std::vector<InputEvent> inputs;
+};
+
+struct Result
+{
+  bool ok = false;
+  unsigned long long framebuffer_hash = 0;
+  double seconds = 0;
+};
+
+struct Options
+{
+  bool version_set = false;
+  Gameboy::GB_VERSION version = Gameboy::GB_VERSION::COLOUR;
+};
+
+void usage()
+{
+  printf("Usage: %s [options] [rom...]\n", name);
+  printf("Options:\n");
+  printf("  -f file               Read jobs from a file, one per line: rom [frames [inputs]]\n");
+  printf("  -n frames             Frames to run for jobs which don't specify it (default: 600)\n");
+  printf("  -j threads            Number of worker threads (default: one per CPU)\n");
+  printf("  -v [original|colour]  Select version of Gameboy to emulate\n");
+  printf("\n");
+  printf("Input files have one button event per line: frame button press|release\n");
+  printf("where button is one of up, down, left, right, a, b, start, select.\n");
+}
+
+static bool parse_button(const std::string &str, Joypad::Button::Name &button)
+{
+  static const struct
+  {
+    const char *name;
+    Joypad::Button::Name button;
+  } buttons[] = {
+    {"up",     Joypad::Button::UP},
+    {"down",   Joypad::Button::DOWN},
+    {"left",   Joypad::Button::LEFT},
+    {"right",  Joypad::Button::RIGHT},
+    {"a",      Joypad::Button::A},
+    {"b",      Joypad::Button::B},
+    {"start",  Joypad::Button::START},
+    {"select", Joypad::Button::SELECT},
+  };
+
+  for (const auto &b : buttons)
+  {
+    if (str == b.name)
+    {
+      button = b.button;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool load_inputs(const std::string &input_file, std::vector<InputEvent> &inputs)
+{
+  std::ifstream in(input_file);
+  if (!in.is_open())
+  {
+    fprintf(stderr, "Couldn't load inputs from '%s'\n", input_file.c_str());
+    return false;
+  }
+
+  std::string line;
+  unsigned int line_number = 0;
+  while (std::getline(in, line))
+  {
+    line_number++;
+    std::istringstream fields(line);
+    std::string button, action;
+    InputEvent event;
+    if (!(fields >> event.frame))
+      continue;
+
+    if (!(fields >> button >> action) || !parse_button(button, event.button) ||
+        (action != "press" && action != "release"))
+    {
+      fprintf(stderr, "%s:%u: Invalid input event\n", input_file.c_str(), line_number);
+      return false;
+    }
+    event.pressed = (action == "press");
+    inputs.push_back(event);
+  }
+
+  std::stable_sort(inputs.begin(), inputs.end(),
+                   [](const InputEvent &a, const InputEvent &b) { return a.frame < b.frame; });
+  return true;
+}
+
+static bool load_jobs(const std::string &job_file, unsigned long default_frames,
+                      std::vector<Job> &jobs)
+{
+  std::ifstream in(job_file);
+  if (!in.is_open())
+  {
+    fprintf(stderr, "Couldn't load jobs from '%s'\n", job_file.c_str());
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream fields(line);
+    Job job;
+    if (!(fields >> job.rom_file) || job.rom_file[0] == '#')
+      continue;
+
+    if (!(fields >> job.frames))
+      job.frames = default_frames;
+
+    std::string input_file;
+    if (fields >> input_file && !load_inputs(input_file, job.inputs))
+      return false;
+
+    jobs.push_back(std::move(job));
+  }
+  return true;
+}
+
+static unsigned long long hash_framebuffer(const Gameboy &gb)
+{
+  // FNV-1a
+  const u8 *data = gb.get_framebuffer();
+  const size_t size = gb.get_framebuffer_size();
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i=0; i<size; i++)
+  {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void run_job(const Job &job, const Options &options, Result &result)
+{
+  if (!job.rom)
+  {
+    fprintf(stderr, "Couldn't load ROM from '%s'\n", job.rom_file.c_str());
+    return;
+  }
+
+  // Loading an unsupported cartridge aborts, which would take every other
+  // job down with it
+  if (!Gameboy::is_supported(*job.rom))
+  {
+    fprintf(stderr, "Can't run ROM '%s'\n", job.rom_file.c_str());
+    return;
+  }
+
+  // Too big to want on a worker thread's stack
+  std::unique_ptr<Gameboy> gb(new Gameboy);
+  if (options.version_set)
+  {
+    gb->set_version(options.version);
+  }
+
+  // Every job starts with blank cartridge RAM and never writes it back out
+  std::istringstream ram;
+  gb->load_rom(job.rom, ram);
+
+  auto start = std::chrono::steady_clock::now();
+
+  size_t next_input = 0;
+  for (unsigned long frame = 0; frame < job.frames; frame++)
+  {
+    for (; next_input < job.inputs.size() && job.inputs[next_input].frame <= frame; next_input++)
+    {
+      const InputEvent &event = job.inputs[next_input];
+      event.pressed ? gb->button_pressed(event.button) :
+                      gb->button_released(event.button);
+    }
+    gb->run_to_vblank();
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  result.seconds = std::chrono::duration<double>(end - start).count();
+  result.framebuffer_hash = hash_framebuffer(*gb);
+  result.ok = true;
+}
+
+int main(int argc, char *argv[])
+{
+  name = argv[0];
+  if (argc < 2)
+  {
+    usage();
+    return 1;
+  }
+
+  Options options;
+  std::string job_file;
+  unsigned long default_frames = 600;
+  unsigned int threads = std::thread::hardware_concurrency();
+  int c;
+  while ((c = getopt(argc, argv, "f:n:j:v:")) != -1)
+  {
+    switch (c)
+    {
+      case 'f':
+        job_file = optarg;
+        break;
+      case 'n':
+      {
+        char *end;
+        default_frames = strtoul(optarg, &end, 10);
+        if (*end != '\0')
+        {
+          fprintf(stderr, "Invalid number of frames: '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      }
+      case 'j':
+      {
+        char *end;
+        threads = strtoul(optarg, &end, 10);
+        if (*end != '\0' || threads == 0)
+        {
+          fprintf(stderr, "Invalid number of threads: '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      }
+      case 'v':
+      {
+        std::string arg = optarg;
+        if (arg == "original")
+        {
+          options.version = Gameboy::GB_VERSION::ORIGINAL;
+        }
+        else if (arg == "colour")
+        {
+          options.version = Gameboy::GB_VERSION::COLOUR;
+        }
+        else
+        {
+          fprintf(stderr, "Invalid Gameboy version: '%s'\n", optarg);
+          return 1;
+        }
+        options.version_set = true;
+        break;
+      }
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  std::vector<Job> jobs;
+  if (!job_file.empty() && !load_jobs(job_file, default_frames, jobs))
+  {
+    return 1;
+  }
+  for (int i=optind; i<argc; i++)
+  {
+    Job job;
+    job.rom_file = argv[i];
+    job.frames = default_frames;
+    jobs.push_back(std::move(job));
+  }
+
+  if (jobs.empty())
+  {
+    usage();
+    return 1;
+  }
+
+  // Mapping a ROM which is already mapped shares the existing mapping, so
+  // however many jobs run a ROM, it's only in memory once
+  for (Job &job : jobs)
+  {
+    job.rom = RomImage::map(job.rom_file);
+  }
+
+  if (threads == 0)
+    threads = 1;
+  if (threads > jobs.size())
+    threads = jobs.size();
+
+  // Workers take the next unclaimed job until there are none left, so
+  // uneven job lengths still keep every thread busy
+  std::vector<Result> results(jobs.size());
+  std::atomic<size_t> next_job(0);
+
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> workers;
+  for (unsigned int i=0; i<threads; i++)
+  {
+    workers.emplace_back([&]()
+    {
+      for (size_t job; (job = next_job++) < jobs.size(); )
+      {
+        run_job(jobs[job], options, results[job]);
+      }
+    });
+  }
+  for (std::thread &worker : workers)
+  {
+    worker.join();
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  unsigned long total_frames = 0;
+  size_t failed = 0;
+  for (size_t i=0; i<jobs.size(); i++)
+  {
+    if (!results[i].ok)
+    {
+      printf("%s FAILED\n", jobs[i].rom_file.c_str());
+      failed++;
+      continue;
+    }
+    printf("%s %lu %016llx %.3f\n", jobs[i].rom_file.c_str(), jobs[i].frames,
+           results[i].framebuffer_hash, results[i].seconds);
+    total_frames += jobs[i].frames;
+  }
+
+  printf("Ran %zu jobs (%lu frames) on %u threads in %.3f seconds (%.1f frames/s)\n",
+         jobs.size(), total_frames, threads, seconds, total_frames / seconds);
+
+  return failed ? 1 : 0;
+}
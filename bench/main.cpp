@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "core/gameboy.h"
+#include "roms.h"
+
+static char *name;
+
+struct Result
+{
+  std::string rom;
+  unsigned long frames;
+  unsigned long long steps;
+  unsigned long long cycles;
+  unsigned long long idle_cycles;
+  double seconds;
+};
+
+void usage()
+{
+  printf("Usage: %s [options] [rom...]\n", name);
+  printf("Runs each ROM headlessly and reports the emulation speed. ROMs may be\n");
+  printf("files or the names of built in synthetic ROMs (default: all of them):\n");
+  for (const SyntheticRom &rom : synthetic_roms())
+  {
+    printf("  %-20s  %s\n", rom.name, rom.description);
+  }
+  printf("Options:\n");
+  printf("  -n frames             Frames to run each ROM for (default: 600)\n");
+  printf("  -r runs               Times to run each ROM, keeping the fastest (default: 3)\n");
+  printf("  -o file               Also write the results to a CSV file\n");
+}
+
+static bool load_rom_file(const std::string &rom_file, std::vector<u8> &data)
+{
+  std::ifstream in(rom_file, std::ios::binary);
+  if (!in.is_open())
+  {
+    fprintf(stderr, "Couldn't load ROM from '%s'\n", rom_file.c_str());
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+  // Caught here rather than aborting halfway through the benchmark
+  if (!Gameboy::is_supported(*RomImage::create(data)))
+  {
+    fprintf(stderr, "Can't run ROM '%s'\n", rom_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+static Result run(const std::string &rom_name, const std::vector<u8> &data,
+                  unsigned long frames)
+{
+  std::unique_ptr<Gameboy> gb(new Gameboy);
+  std::istringstream rom(std::string(data.begin(), data.end()));
+  std::istringstream ram;
+  gb->load_rom(rom, ram);
+
+  Result result = {rom_name, frames, 0, 0, 0, 0};
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long frame = 0; frame < frames; frame++)
+  {
+    result.steps += gb->run_to_vblank();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  result.seconds = std::chrono::duration<double>(end - start).count();
+  result.cycles = gb->get_cycles();
+  result.idle_cycles = gb->get_idle_cycles();
+  return result;
+}
+
+int main(int argc, char *argv[])
+{
+  name = argv[0];
+
+  unsigned long frames = 600;
+  unsigned long runs = 3;
+  std::string csv_file;
+  int c;
+  while ((c = getopt(argc, argv, "n:r:o:h")) != -1)
+  {
+    switch (c)
+    {
+      case 'n':
+      case 'r':
+      {
+        char *end;
+        unsigned long value = strtoul(optarg, &end, 10);
+        if (*end != '\0' || value == 0)
+        {
+          fprintf(stderr, "Invalid number of %s: '%s'\n", c == 'n' ? "frames" : "runs", optarg);
+          return 1;
+        }
+        (c == 'n' ? frames : runs) = value;
+        break;
+      }
+      case 'o':
+        csv_file = optarg;
+        break;
+      case 'h':
+        usage();
+        return 0;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  std::vector<SyntheticRom> roms = synthetic_roms();
+  if (optind < argc)
+  {
+    std::vector<SyntheticRom> selected;
+    for (int i=optind; i<argc; i++)
+    {
+      bool found = false;
+      for (const SyntheticRom &rom : roms)
+      {
+        if (rom.name == std::string(argv[i]))
+        {
+          selected.push_back(rom);
+          found = true;
+          break;
+        }
+      }
+
+      if (!found)
+      {
+        SyntheticRom rom = {argv[i], "", {}};
+        if (!load_rom_file(argv[i], rom.data))
+          return 1;
+        selected.push_back(std::move(rom));
+      }
+    }
+    roms = std::move(selected);
+  }
+
+  std::vector<Result> results;
+  for (const SyntheticRom &rom : roms)
+  {
+    Result best = run(rom.name, rom.data, frames);
+    for (unsigned long i=1; i<runs; i++)
+    {
+      Result result = run(rom.name, rom.data, frames);
+      if (result.seconds < best.seconds)
+        best = result;
+    }
+    results.push_back(best);
+  }
+
+  printf("Interpreter: %s\n", LR35902::interpreter());
+  printf("%-20s %10s %12s %12s %10s %8s\n", "ROM", "frames", "frames/s", "Msteps/s", "ns/step", "idle%");
+  for (const Result &r : results)
+  {
+    printf("%-20s %10lu %12.1f %12.2f %10.2f %8.1f\n", r.rom.c_str(), r.frames,
+           r.frames / r.seconds, r.steps / r.seconds / 1e6, r.seconds * 1e9 / r.steps,
+           100.0 * r.idle_cycles / r.cycles);
+  }
+
+  if (!csv_file.empty())
+  {
+    FILE *csv = fopen(csv_file.c_str(), "w");
+    if (!csv)
+    {
+      fprintf(stderr, "Couldn't write results to '%s'\n", csv_file.c_str());
+      return 1;
+    }
+    fprintf(csv, "rom,interpreter,frames,steps,seconds,frames_per_second,steps_per_second,ns_per_step,cycles,idle_cycles\n");
+    for (const Result &r : results)
+    {
+      fprintf(csv, "%s,%s,%lu,%llu,%.6f,%.2f,%.0f,%.3f,%llu,%llu\n", r.rom.c_str(), LR35902::interpreter(),
+              r.frames, r.steps,
+              r.seconds, r.frames / r.seconds, r.steps / r.seconds, r.seconds * 1e9 / r.steps,
+              r.cycles, r.idle_cycles);
+    }
+    fclose(csv);
+  }
+
+  return 0;
+}
@@ -0,0 +1,387 @@
+#include "roms.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <initializer_list>
+#include <map>
+#include <string>
+
+namespace {
+
+// Just enough of an assembler to lay out hand-encoded instructions and
+// resolve jumps to labels
+class Assembler
+{
+public:
+  explicit Assembler(size_t size = 0x8000) : rom(size) { }
+
+  void org(uint address) { pc = address; }
+  void label(const std::string &name) { labels[name] = pc; }
+
+  void db(std::initializer_list<int> bytes)
+  {
+    for (int byte : bytes)
+    {
+      rom[pc++] = byte;
+    }
+  }
+
+  void dw(uint word) { db({static_cast<int>(word & 0xff), static_cast<int>(word >> 8)}); }
+
+  void dw(const std::string &target)
+  {
+    fixups.push_back({pc, target, false});
+    db({0, 0});
+  }
+
+  // Relative jump: JR (0x18), JR NZ (0x20), JR Z (0x28), ...
+  void jr(int opcode, const std::string &target)
+  {
+    db({opcode});
+    fixups.push_back({pc, target, true});
+    db({0});
+  }
+
+  std::vector<u8> finish()
+  {
+    for (const Fixup &fixup : fixups)
+    {
+      auto it = labels.find(fixup.target);
+      if (it == labels.end())
+      {
+        fprintf(stderr, "Undefined label: %s\n", fixup.target.c_str());
+        abort();
+      }
+
+      uint target = it->second;
+      if (fixup.relative)
+      {
+        int offset = static_cast<int>(target) - static_cast<int>(fixup.address + 1);
+        if (offset < -128 || offset > 127)
+        {
+          fprintf(stderr, "Jump to %s out of range\n", fixup.target.c_str());
+          abort();
+        }
+        rom[fixup.address] = offset;
+      }
+      else
+      {
+        rom[fixup.address] = target & 0xff;
+        rom[fixup.address+1] = target >> 8;
+      }
+    }
+    return rom;
+  }
+
+  std::vector<u8> rom;
+
+private:
+  struct Fixup
+  {
+    uint address;
+    std::string target;
+    bool relative;
+  };
+
+  uint pc = 0;
+  std::map<std::string, uint> labels;
+  std::vector<Fixup> fixups;
+};
+
+void header(Assembler &a, bool cgb, u8 mbc = 0, u8 rom_size = 0)
+{
+  a.org(0x100);
+  a.db({0x00, 0xc3});        // NOP; JP start
+  a.dw("start");
+
+  const char title[] = "SYNTHETIC  ";
+  for (uint i=0; i<sizeof(title)-1; i++)
+  {
+    a.rom[0x134 + i] = title[i];
+  }
+  a.rom[0x143] = cgb ? 0x80 : 0x00;
+  a.rom[0x147] = mbc;
+  a.rom[0x148] = rom_size;
+}
+
+// Pseudo-random tile data at 0x2000, copied into VRAM by common_init()
+void tiles(Assembler &a)
+{
+  for (uint i=0; i<0x1000; i++)
+  {
+    a.rom[0x2000 + i] = (i * 37 ^ (i >> 4) * 11) & 0xff;
+  }
+}
+
+// Sets up VRAM, the sprite table at 0xc000, palettes and sound, leaving the
+// LCD and interrupts for the caller to enable
+void common_init(Assembler &a, bool cgb)
+{
+  a.label("start");
+  a.db({0xf3});              // DI
+  a.db({0x31}); a.dw(0xfffe); // LD SP, 0xfffe
+
+  // Copy 0x1000 bytes of tile data to 0x8000
+  a.db({0x21}); a.dw(0x8000); // LD HL, 0x8000
+  a.db({0x11}); a.dw(0x2000); // LD DE, 0x2000
+  a.db({0x01}); a.dw(0x1000); // LD BC, 0x1000
+  a.label("copy");
+  a.db({0x1a, 0x22, 0x13, 0x0b, 0x78, 0xb1}); // LD A, (DE); LDI (HL), A; INC DE; DEC BC; LD A, B; OR C
+  a.jr(0x20, "copy");
+
+  // Fill both tile maps with L^H
+  a.db({0x21}); a.dw(0x9800);
+  a.label("fill");
+  a.db({0x7d, 0xac, 0x22, 0x7c, 0xfe, 0xa0}); // LD A, L; XOR H; LDI (HL), A; LD A, H; CP 0xa0
+  a.jr(0x20, "fill");
+
+  if (cgb)
+  {
+    // Tile attributes in VRAM bank 1: palette and flips from L
+    a.db({0x3e, 1, 0xe0, 0x4f}); // VBK = 1
+    a.db({0x21}); a.dw(0x9800);
+    a.label("attr_fill");
+    a.db({0x7d, 0xe6, 0x6f, 0x22, 0x7c, 0xfe, 0xa0}); // LD A, L; AND 0x6f; LDI (HL), A; LD A, H; CP 0xa0
+    a.jr(0x20, "attr_fill");
+    a.db({0xaf, 0xe0, 0x4f}); // VBK = 0
+
+    // Fill the background and sprite palettes with auto-increment
+    a.db({0x3e, 0x80, 0xe0, 0x68, 0x06, 64, 0x0e, 0x11});
+    a.label("bg_palette");
+    a.db({0x79, 0xe0, 0x69, 0xc6, 0x35, 0x4f, 0x05}); // LD A, C; LDH (BGPD), A; ADD 0x35; LD C, A; DEC B
+    a.jr(0x20, "bg_palette");
+    a.db({0x3e, 0x80, 0xe0, 0x6a, 0x06, 64, 0x0e, 0x11});
+    a.label("obj_palette");
+    a.db({0x79, 0xe0, 0x6b, 0xc6, 0x35, 0x4f, 0x05});
+    a.jr(0x20, "obj_palette");
+  }
+
+  // 40 sprites at 0xc000
+  a.db({0x21}); a.dw(0xc000);
+  a.db({0x06, 40, 0x0e, 0x10}); // LD B, 40; LD C, 0x10
+  a.label("sprites");
+  a.db({0x79, 0x22});       // y = C
+  a.db({0x79, 0x07, 0x22}); // x = C rotated
+  a.db({0x78, 0x22});       // tile = B
+  a.db({0x78, 0x07, 0x07, 0x07, 0x07, 0xe6, 0xf8, 0x22}); // flags from B
+  a.db({0x79, 0xc6, 0x0b, 0x4f, 0x05}); // C += 11; DEC B
+  a.jr(0x20, "sprites");
+
+  a.db({0x3e, 0xe4, 0xe0, 0x47, 0xe0, 0x48, 0x3e, 0x1b, 0xe0, 0x49}); // BGP, OBP0, OBP1
+  a.db({0x3e, 100, 0xe0, 0x4a, 0x3e, 87, 0xe0, 0x4b});             // WY, WX
+  a.db({0x3e, 0x80, 0xe0, 0x26, 0x3e, 0x77, 0xe0, 0x24, 0x3e, 0xff, 0xe0, 0x25}); // Sound on
+}
+
+// Scroll the background, move the sprites and optionally retrigger two
+// sound channels. Preserves all registers.
+void vblank_body(Assembler &a, bool audio)
+{
+  a.db({0xf5, 0xc5, 0xe5});             // PUSH AF, BC, HL
+  a.db({0xf0, 0x43, 0x3c, 0xe0, 0x43}); // SCX++
+  a.db({0xf0, 0x42, 0xc6, 0x03, 0xe0, 0x42}); // SCY += 3
+  a.db({0x3e, 0xc0, 0xe0, 0x46});       // OAM DMA from 0xc000
+
+  // Move every sprite right by one
+  a.db({0x21}); a.dw(0xc001);
+  a.db({0x06, 40});
+  a.label("move");
+  a.db({0x34, 0x23, 0x23, 0x23, 0x23, 0x05}); // INC (HL); INC HL x4; DEC B
+  a.jr(0x20, "move");
+
+  if (audio)
+  {
+    a.db({0xf0, 0x43, 0xe0, 0x13, 0x3e, 0x81, 0xe0, 0x11, 0x3e, 0xf3, 0xe0, 0x12, 0x3e, 0x86, 0xe0, 0x14});
+    a.db({0xf0, 0x42, 0xe0, 0x18, 0x3e, 0x41, 0xe0, 0x16, 0x3e, 0x72, 0xe0, 0x17, 0x3e, 0x85, 0xe0, 0x19});
+  }
+
+  // Frame counter at 0xc100
+  a.db({0xfa}); a.dw(0xc100); a.db({0x3c, 0xea}); a.dw(0xc100);
+  a.db({0xe1, 0xc1, 0xf1});             // POP HL, BC, AF
+}
+
+// The CPU sleeps in HALT between vblank and timer interrupts, so most of the
+// time is spent rendering
+std::vector<u8> rom_halt(bool cgb, u8 lcdc)
+{
+  Assembler a;
+  header(a, cgb);
+  a.org(0x40); a.db({0xc3}); a.dw("vblank");
+  a.org(0x48); a.db({0xd9});
+  a.org(0x50); a.db({0xc3}); a.dw("timer");
+
+  a.org(0x150);
+  common_init(a, cgb);
+  a.db({0x3e, lcdc, 0xe0, 0x40});
+  a.db({0x3e, 0x05, 0xe0, 0xff});             // IE = vblank, timer
+  a.db({0x3e, 0x80, 0xe0, 0x06, 0x3e, 0x05, 0xe0, 0x07}); // TMA, TAC = 16 cycles
+  a.db({0xfb});                               // EI
+  a.label("main");
+  a.db({0x76, 0x00});                         // HALT; NOP
+  a.jr(0x18, "main");
+
+  a.label("vblank");
+  vblank_body(a, true);
+  a.db({0xd9});
+  a.label("timer");
+  a.db({0xf5, 0xfa}); a.dw(0xc101); a.db({0x3c, 0xea}); a.dw(0xc101); a.db({0xf1, 0xd9});
+
+  tiles(a);
+  return a.finish();
+}
+
+// No interrupts - busy-waits on LY like many games do
+std::vector<u8> rom_poll(bool cgb)
+{
+  Assembler a;
+  header(a, cgb);
+  a.org(0x150);
+  common_init(a, cgb);
+  a.db({0x3e, 0xf3, 0xe0, 0x40});
+  a.label("main");
+  a.label("wait_vblank");
+  a.db({0xf0, 0x44, 0xfe, 0x90});             // LDH A, (LY); CP 144
+  a.jr(0x20, "wait_vblank");
+  a.db({0xcd}); a.dw("vblank");
+  a.label("wait_line");
+  a.db({0xf0, 0x44, 0xfe, 0x90});
+  a.jr(0x28, "wait_line");
+  a.db({0xc3}); a.dw("main");
+
+  a.label("vblank");
+  vblank_body(a, true);
+  a.db({0xc9});
+
+  tiles(a);
+  return a.finish();
+}
+
+// Checksums switchable ROM banks in a tight loop, with MBC1 bank switches
+std::vector<u8> rom_cpu()
+{
+  Assembler a(0x20000);
+  header(a, false, 0x01, 0x02);
+  a.org(0x40); a.db({0xc3}); a.dw("vblank");
+
+  a.org(0x150);
+  common_init(a, false);
+  a.db({0x3e, 0x91, 0xe0, 0x40, 0x3e, 0x01, 0xe0, 0xff, 0xfb});
+  a.label("main");
+  a.db({0x3e, 0x01});
+  a.label("bank");
+  a.db({0xea}); a.dw(0x2000); a.db({0x5f});   // Select bank A, E = bank
+  a.db({0x21}); a.dw(0x4000);
+  a.db({0x01}); a.dw(0x0400);
+  a.db({0x16, 0});
+  a.label("sum");
+  a.db({0x7e, 0x82, 0xcb, 0x07, 0xa8, 0x57, 0x23, 0x0b, 0x78, 0xb1}); // D = rlc(D + (HL)) ^ B
+  a.jr(0x20, "sum");
+  a.db({0x7a, 0xea}); a.dw(0x9800);           // Show the checksum
+  a.db({0x7b, 0x3c, 0xfe, 0x08});
+  a.jr(0x20, "bank");
+  a.db({0xc3}); a.dw("main");
+
+  a.label("vblank");
+  vblank_body(a, false);
+  a.db({0xd9});
+
+  tiles(a);
+  for (uint bank=1; bank<8; bank++)
+  {
+    for (uint i=0; i<0x4000; i++)
+    {
+      a.rom[bank*0x4000 + i] = (i * bank + bank) & 0xff;
+    }
+  }
+  return a.finish();
+}
+
+// 8x16 sprites in four rows of ten, 32 lines apart. The 64 lines the rows
+// cover have the maximum of ten sprites each - there aren't enough sprites
+// to fill every line
+std::vector<u8> rom_sprites()
+{
+  Assembler a;
+  header(a, false);
+  a.org(0x40); a.db({0xc3}); a.dw("vblank");
+
+  a.org(0x150);
+  common_init(a, false);
+
+  // Replace the sprite table with one from ROM
+  a.db({0x21}); a.dw(0xc000);
+  a.db({0x11}); a.dw(0x3000);
+  a.db({0x06, 160});
+  a.label("copy_sprites");
+  a.db({0x1a, 0x22, 0x13, 0x05});             // LD A, (DE); LDI (HL), A; INC DE; DEC B
+  a.jr(0x20, "copy_sprites");
+
+  a.db({0x3e, 0x87, 0xe0, 0x40});             // LCD on, 8x16 sprites, no window
+  a.db({0x3e, 0x01, 0xe0, 0xff, 0xfb});
+  a.label("main");
+  a.db({0x76, 0x00});
+  a.jr(0x18, "main");
+
+  a.label("vblank");
+  vblank_body(a, false);
+  a.db({0xd9});
+
+  tiles(a);
+  for (uint i=0; i<40; i++)
+  {
+    u8 *sprite = &a.rom[0x3000 + i*4];
+    sprite[0] = 16 + (i / 10) * 32;
+    sprite[1] = 8 + (i % 10) * 15;
+    sprite[2] = i * 2;
+    sprite[3] = ((i & 1) ? 0x20 : 0) | ((i & 2) ? 0x10 : 0) | ((i & 4) ? 0x80 : 0);
+  }
+  return a.finish();
+}
+
+// Continuously rewrites and retriggers every sound channel
+std::vector<u8> rom_audio()
+{
+  Assembler a;
+  header(a, false);
+  a.org(0x40); a.db({0xc3}); a.dw("vblank");
+
+  a.org(0x150);
+  common_init(a, false);
+  a.db({0x3e, 0xf3, 0xe0, 0x12, 0xe0, 0x17, 0xe0, 0x21}); // Envelopes for channels 1, 2 and 4
+  a.db({0x3e, 0x20, 0xe0, 0x1c});             // Channel 3 full volume
+  a.db({0x3e, 0x91, 0xe0, 0x40, 0x3e, 0x01, 0xe0, 0xff, 0xfb});
+  a.db({0x21}); a.dw(0xff30);                 // HL = wave RAM
+  a.label("main");
+  a.db({0xf0, 0x44, 0xe0, 0x13});             // Channel 1 frequency from LY
+  a.db({0x3e, 0x86, 0xe0, 0x14});             // Retrigger channel 1
+  a.db({0xf0, 0x04, 0xe0, 0x18});             // Channel 2 frequency from DIV
+  a.db({0x3e, 0x85, 0xe0, 0x19});             // Retrigger channel 2
+  a.db({0x3e, 0x00, 0xe0, 0x1a});             // Channel 3 off while writing wave RAM
+  a.db({0xf0, 0x04, 0x77});                   // LD (HL), DIV
+  a.db({0x7d, 0x3c, 0xe6, 0x3f, 0xf6, 0x30, 0x6f}); // L = 0x30 + (L+1)%16
+  a.db({0x3e, 0x80, 0xe0, 0x1a});             // Channel 3 on
+  a.db({0xf0, 0x44, 0xe0, 0x1d});
+  a.db({0x3e, 0x87, 0xe0, 0x1e});             // Retrigger channel 3
+  a.db({0xf0, 0x04, 0xe0, 0x22});             // Noise parameters from DIV
+  a.db({0x3e, 0x80, 0xe0, 0x23});             // Retrigger channel 4
+  a.jr(0x18, "main");
+
+  a.label("vblank");
+  vblank_body(a, true);
+  a.db({0xd9});
+
+  tiles(a);
+  return a.finish();
+}
+
+}  // namespace
+
+std::vector<SyntheticRom> synthetic_roms()
+{
+  return {
+    {"cpu", "ALU loop over switched ROM banks", rom_cpu()},
+    {"ppu", "CGB background and window while halted", rom_halt(true, 0xf1)},
+    {"sprites", "Four rows of ten 8x16 sprites", rom_sprites()},
+    {"audio", "Sound registers rewritten continuously", rom_audio()},
+    {"poll", "CGB game busy-waiting on LY", rom_poll(true)},
+  };
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+#include "types.h"
+
+// ROMs assembled at runtime, each stressing a different part of the emulator
+struct SyntheticRom
+{
+  const char *name;
+  const char *description;
+  std::vector<u8> data;
+};
+
+std::vector<SyntheticRom> synthetic_roms();
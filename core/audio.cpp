@@ -1,12 +1,13 @@
 #include "audio.h"
 #include "memory.h"
+#include "scheduler.h"
+#include "state.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 
-int Audio::freq_to_hz(int freq)
+AudioOutput::~AudioOutput()
 {
-  return 131072 / (2048 - freq);
 }
 
 int Audio::snd_len_to_cycles(int len)
@@ -19,8 +20,15 @@ int Audio::envelope_cycles_per_step(int len)
   return len * (4194304 / 64);
 }
 
+// Samples are mixed at least this often while an output is attached, so it
+// gets a steady stream of them even if no registers are written
+static const uint mix_interval = 4194304 / 256;
+
 void Audio::update(uint cycles)
 {
+  if (aout && !muted)
+    mix(cycles);
+
   for (int i=0; i<4; i++)
   {
     channel_state[i].counter += cycles;
@@ -46,6 +54,66 @@ void Audio::update(uint cycles)
   }
 }
 
+uint Audio::cycles_until_update() const
+{
+  uint cycles = Scheduler::no_event;
+
+  // Only envelope steps need to happen at a particular time
+  for (int i=0; i<4; i++)
+  {
+    if (channel_data[i].envelope_steps > 0 && channel_state[i].envelope_step > 0)
+    {
+      int env_step_length = envelope_cycles_per_step(channel_data[i].envelope_steps);
+      int remaining = env_step_length - channel_state[i].envelope_counter + 1;
+      if (remaining < 1)
+      {
+        remaining = 1;
+      }
+      if ((uint)remaining < cycles)
+      {
+        cycles = remaining;
+      }
+    }
+  }
+
+  if (aout && !muted && mix_interval < cycles)
+  {
+    cycles = mix_interval;
+  }
+
+  return cycles;
+}
+
+void Audio::mix(uint cycles)
+{
+  sample_cycles += static_cast<u64>(cycles) << 16;
+  while (sample_cycles >= cycles_per_sample)
+  {
+    sample_cycles -= cycles_per_sample;
+
+    int value = 0;
+    for (int i=0; i<4; i++)
+    {
+      if (!playing[i])
+        continue;
+
+      // Each of the 8 steps of a waveform lasts 4 cycles per unit of
+      // frequency below 2048
+      u64 step_length = static_cast<u64>(2048 - channel_data[i].freq) * 4 << 16;
+      phase[i] = (phase[i] + cycles_per_sample) % (step_length * 8);
+      value += channels[i][phase[i] / step_length];
+    }
+
+    // Room for all 4 channels at full volume
+    mixed[mixed_count++] = value * 64;
+    if (mixed_count == mix_length)
+    {
+      aout->write_samples(mixed, mixed_count);
+      mixed_count = 0;
+    }
+  }
+}
+
 void Audio::reset()
 {
   write_byte(Memory::IO::NR10, 0);
@@ -78,6 +146,7 @@ void Audio::reset()
 void Audio::restart_channel(int channel)
 {
   channel_state[channel].counter = 0;
+  phase[channel] = 0;
 
   channel_data[channel].on = true;
 }
@@ -95,7 +164,7 @@ void Audio::update_channel1()
        snd_len_to_cycles(channel_data[0].snd_len) < channel_state[0].counter))
   {
     // don't play sound
-    aout.stop_channel(0);
+    stop_channel(0);
     channel_data[0].on = false;
     return;
   }
@@ -123,7 +192,7 @@ void Audio::update_channel1()
   if (debug)
     puts("\n");
 
-  aout.play_channel(0, freq_to_hz(channel_data[0].freq));
+  play_channel(0);
 }
 
 void Audio::update_channel2()
@@ -133,7 +202,7 @@ void Audio::update_channel2()
        snd_len_to_cycles(channel_data[1].snd_len) < channel_state[1].counter))
   {
     // don't play sound
-    aout.stop_channel(1);
+    stop_channel(1);
     channel_data[1].on = false;
     return;
   }
@@ -154,7 +223,7 @@ void Audio::update_channel2()
   if (debug)
     puts("\n");
 
-  aout.play_channel(1, freq_to_hz(channel_data[1].freq));
+  play_channel(1);
 }
 
 void Audio::update_channel3()
@@ -438,13 +507,67 @@ void Audio::write_byte(uint address, u8 value)
   }
 }
 
-void Audio::set_muted(bool muted)
+void Audio::save_state(StateWriter &state) const
+{
+  state.write(volume);
+  state.write(terminal_selection);
+  state.write(sound_enabled);
+  state.write(wave_data);
+  state.write(channel_data);
+  state.write(wave_enabled);
+  state.write(channel_state);
+}
+
+void Audio::load_state(StateReader &state)
+{
+  state.read(volume);
+  state.read(terminal_selection);
+  state.read(sound_enabled);
+  state.read(wave_data);
+  state.read(channel_data);
+  state.read(wave_enabled);
+  state.read(channel_state);
+
+  for (int i=0; i<4; i++)
+  {
+    channel_data[i].wave_duty &= 0x3;
+  }
+
+  // Restart output of whatever was playing
+  update_channel1();
+  update_channel2();
+  update_channel3();
+  update_channel4();
+}
+
+void Audio::play_channel(int channel)
+{
+  playing[channel] = true;
+}
+
+void Audio::stop_channel(int channel)
+{
+  playing[channel] = false;
+}
+
+void Audio::set_output(AudioOutput *output)
+{
+  aout = output;
+  if (aout)
+  {
+    aout->debug = debug;
+    cycles_per_sample = (static_cast<u64>(4194304) << 16) / aout->get_sample_rate();
+  }
+}
+
+void Audio::set_muted(bool muted_)
 {
-  aout.muted = muted;
+  muted = muted_;
 }
 
 void Audio::set_debug(bool debug_)
 {
   debug = debug_;
-  aout.debug = debug_;
+  if (aout)
+    aout->debug = debug_;
 }
@@ -2,34 +2,63 @@
 
 #include "types.h"
 
-#include "glfw/openal.h"
-
 class Memory;
+class StateWriter;
+class StateReader;
+
+// Implemented by frontends to play the sound generated as the emulator runs
+class AudioOutput
+{
+public:
+  virtual ~AudioOutput();
+
+  // Samples per second to mix the channels at
+  virtual uint get_sample_rate() const = 0;
+  // Called with each batch of mixed mono samples, a few milliseconds' worth
+  // at a time. The output has to keep up, or drop them, as the emulator
+  // never waits for it.
+  virtual void write_samples(const s16 *samples, uint count) = 0;
+
+  bool debug = false;
+};
 
 class Audio
 {
 public:
   Audio() = delete;
-  explicit Audio(Memory &mem) : memory(mem),
-                                aout(*this) { }
+  explicit Audio(Memory &mem) : memory(mem) { }
 
   void update(uint cycles);
+  uint cycles_until_update() const;
 
   u8 read_byte(uint address) const;
   void write_byte(uint address, u8 value);
 
   const s8 *get_channel(int channel) const { return &channels[channel][0]; }
 
-  void set_muted(bool muted);
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
+
+  void set_output(AudioOutput *output);
+  void set_muted(bool muted_);
+  bool is_muted() const { return muted; }
   void set_debug(bool debug_);
 
 private:
   Memory &memory;
-  AudioOut aout;
 
+  // No output is attached when running headless
+  AudioOutput *aout = nullptr;
+
+  bool muted = false;
   bool debug = false;
 
-  static int freq_to_hz(int freq);
+  void play_channel(int channel);
+  void stop_channel(int channel);
+
+  // Adds the samples for the last cycles to the output's stream
+  void mix(uint cycles);
+
   static int snd_len_to_cycles(int len);
   static int envelope_cycles_per_step(int len);
 
@@ -53,11 +82,11 @@ private:
     {-0x7f, -0x7f, -0x7f, -0x7f, -0x7f, -0x7f,  0x7f,  0x7f},
   };
 
-  int volume[2];
+  int volume[2] = {};
   u8 terminal_selection = 0;
   bool sound_enabled = false;
 
-  u8 wave_data[16];
+  u8 wave_data[16] = {};
 
   struct
   {
@@ -87,7 +116,7 @@ private:
     int freq;
 
     bool on;
-  } channel_data[4];
+  } channel_data[4] = {};
   bool wave_enabled = false;
 
   struct
@@ -95,5 +124,17 @@ private:
     int counter;
     int envelope_counter;
     int envelope_step;
-  } channel_state[4];
+  } channel_state[4] = {};
+
+  // Mixing isn't part of the saved state, as it only depends on the output
+  bool playing[4] = {};
+  // 16.16 fixed point cycles: per output sample, since the last sample, and
+  // into each channel's waveform
+  u64 cycles_per_sample = 0;
+  u64 sample_cycles = 0;
+  u64 phase[4] = {};
+
+  static const uint mix_length = 512;
+  s16 mixed[mix_length];
+  uint mixed_count = 0;
 };
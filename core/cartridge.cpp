@@ -1,151 +1,239 @@
+#include <string.h>
+#include <algorithm>
+
 #include "cartridge.h"
 #include "gameboy.h"
 
-void Cartridge::init_cartridge(std::istream& rom_stream, std::istream& ram_stream)
+void Cartridge::init_cartridge(std::shared_ptr<const RomImage> rom_image, std::istream& ram_stream)
 {
-  // The cartridge header is located at 0x100 - 0x14f
-  // Include the first 0x100 bytes here to make addressing easier
-  const uint header_size = 0x150;
-  char header[header_size];
-
-  rom_stream.read(header, header_size);
+  // Anything still to be saved goes where it was loaded from
+  mbc.reset();
+  save_file.reset();
 
-  u8 cgb_flag       = header[0x143];
-  u8 cartridge_type = header[0x147];
-  u8 rom_size_code  = header[0x148];
-  u8 ram_size_code  = header[0x149];
+  Header header;
+  if (!read_header(*rom_image, header))
+  {
+    abort();
+  }
 
   // Auto select gameboy version to run if user hasn't specified
   if (gb.gb_version_set == false)
   {
-    if (cgb_flag & (1<<7))
+    if (header.cgb_flag & (1<<7))
     {
-      if (cgb_flag & (1<<6))
+      if (header.cgb_flag & (1<<6))
       {
         // Game only works on CGB
         gb.set_version(Gameboy::GB_VERSION::COLOUR);
-        printf("Running in Gameboy Colour mode\n");
+        fprintf(stderr, "Running in Gameboy Colour mode\n");
       }
       else
       {
         // Game supports colour and original - choose colour
         gb.set_version(Gameboy::GB_VERSION::COLOUR);
-        printf("Running in Gameboy Colour mode\n");
+        fprintf(stderr, "Running in Gameboy Colour mode\n");
       }
     }
     else
     {
       // Game only supports original
       gb.set_version(Gameboy::GB_VERSION::ORIGINAL);
-      printf("Running in original Gameboy mode\n");
+      fprintf(stderr, "Running in original Gameboy mode\n");
     }
   }
 
-  init_mbc(cartridge_type);
-  init_rom(rom_size_code);
-  init_ram(ram_size_code);
+  // The ROM is used in place, unless the file is shorter than the header
+  // says and needs padding out
+  if (rom_image->size() < header.rom_size)
+  {
+    std::vector<u8> padded(header.rom_size);
+    memcpy(padded.data(), rom_image->data(), rom_image->size());
+    rom_image = RomImage::create(std::move(padded));
+  }
+  rom = std::move(rom_image);
 
-  // Load the entire cartridge into our ROM buffer
-  rom_stream.seekg(0);
-  rom_stream.read(reinterpret_cast<char *>(rom.data()), rom.size());
+  ram.resize(header.ram_size);
+  mbc_type = header.mbc_type;
+  init_mbc(header.rom_size);
 
   ram_stream.read(reinterpret_cast<char *>(ram.data()), ram.size());
 }
 
-void Cartridge::init_mbc(uint type)
+bool Cartridge::is_supported(const RomImage &rom_image)
 {
-  switch (type)
+  Header header;
+  return read_header(rom_image, header);
+}
+
+bool Cartridge::read_header(const RomImage &rom_image, Header &header)
+{
+  // The cartridge header is located at 0x100 - 0x14f
+  // Include the first 0x100 bytes here to make addressing easier
+  const uint header_size = 0x150;
+  u8 data[header_size] = {};
+
+  memcpy(data, rom_image.data(), std::min<size_t>(rom_image.size(), header_size));
+
+  u8 cartridge_type = data[0x147];
+  u8 rom_size_code  = data[0x148];
+  u8 ram_size_code  = data[0x149];
+
+  header.cgb_flag = data[0x143];
+  if (!mbc_type_for(cartridge_type, header.mbc_type))
   {
-    case 0x00:
+    fprintf(stderr, "Unsupported cartridge type: %02X\n", cartridge_type);
+    return false;
+  }
+  if (!rom_size(rom_size_code, header.rom_size))
+  {
+    fprintf(stderr, "Unsupported ROM size: %02X\n", rom_size_code);
+    return false;
+  }
+  if (!ram_size(ram_size_code, header.ram_size))
+  {
+    fprintf(stderr, "Unsupported RAM size: %02X\n", ram_size_code);
+    return false;
+  }
+  return true;
+}
+
+void Cartridge::init_mbc(uint size)
+{
+  switch (mbc_type)
+  {
+    case MBCType::NONE:
       // ROM only
-      mbc = std::make_unique<NoMBC>(rom, ram);
+      mbc = std::make_unique<NoMBC>(rom->data(), size, ram.data(), ram.size());
       break;
-    case 0x01: case 0x02: case 0x03:
-      // MBC1
-      mbc = std::make_unique<MBC1>(rom, ram);
+    case MBCType::MBC1:
+      mbc = std::make_unique<MBC1>(rom->data(), size, ram.data(), ram.size());
       break;
-    case 0x0f: case 0x10: case 0x11: case 0x12: case 0x13:
-      // MBC3
-      mbc = std::make_unique<MBC3>(rom, ram);
+    case MBCType::MBC3:
+      mbc = std::make_unique<MBC3>(rom->data(), size, ram.data(), ram.size());
       break;
     default:
-      fprintf(stderr, "Unsupported cartridge type: %02X\n", type);
       abort();
   }
 }
 
-void Cartridge::init_rom(uint size_code)
+bool Cartridge::mbc_type_for(uint type, MBCType &mbc_type)
+{
+  switch (type)
+  {
+    case 0x00:
+      // ROM only
+      mbc_type = MBCType::NONE;
+      return true;
+    case 0x01: case 0x02: case 0x03:
+      mbc_type = MBCType::MBC1;
+      return true;
+    case 0x0f: case 0x10: case 0x11: case 0x12: case 0x13:
+      mbc_type = MBCType::MBC3;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool Cartridge::rom_size(uint size_code, uint &size)
 {
   switch (size_code)
   {
     case 0x00:
-      rom.resize(0x8000); // 32 KB
-      break;
+      size = 0x8000; // 32 KB
+      return true;
     case 0x01:
-      rom.resize(0x10000); // 64 KB
-      break;
+      size = 0x10000; // 64 KB
+      return true;
     case 0x02:
-      rom.resize(0x20000); // 128 KB
-      break;
+      size = 0x20000; // 128 KB
+      return true;
     case 0x03:
-      rom.resize(0x40000); // 256 KB
-      break;
+      size = 0x40000; // 256 KB
+      return true;
     case 0x04:
-      rom.resize(0x80000); // 512 KB
-      break;
+      size = 0x80000; // 512 KB
+      return true;
     case 0x05:
-      rom.resize(0x100000); // 1 MB
-      break;
+      size = 0x100000; // 1 MB
+      return true;
     case 0x06:
-      rom.resize(0x200000); // 2 MB
-      break;
+      size = 0x200000; // 2 MB
+      return true;
     case 0x07:
-      rom.resize(0x400000); // 4 MB
-      break;
+      size = 0x400000; // 4 MB
+      return true;
     case 0x52:
-      rom.resize(0x120000); // 1.125 MB
-      break;
+      size = 0x120000; // 1.125 MB
+      return true;
     case 0x53:
-      rom.resize(0x140000); // 1.25 MB
-      break;
+      size = 0x140000; // 1.25 MB
+      return true;
     case 0x54:
-      rom.resize(0x180000); // 1.5 MB
-      break;
+      size = 0x180000; // 1.5 MB
+      return true;
     default:
-      fprintf(stderr, "Unsupported ROM size: %02X\n", size_code);
-      abort();
+      return false;
   }
 }
 
-void Cartridge::init_ram(uint size_code)
+bool Cartridge::ram_size(uint size_code, uint &size)
 {
   switch (size_code)
   {
     case 0x00:
-      ram.resize(0); // None
-      break;
+      size = 0; // None
+      return true;
     case 0x01:
-      ram.resize(0x800); // 2 KB
-      break;
+      size = 0x800; // 2 KB
+      return true;
     case 0x02:
-      ram.resize(0x2000); // 8 KB
-      break;
+      size = 0x2000; // 8 KB
+      return true;
     case 0x03:
-      ram.resize(0x8000); // 32 KB
-      break;
+      size = 0x8000; // 32 KB
+      return true;
     case 0x04:
-      ram.resize(0x20000); // 128 KB
-      break;
+      size = 0x20000; // 128 KB
+      return true;
     case 0x05:
-      ram.resize(0x10000); // 64 KB
-      break;
+      size = 0x10000; // 64 KB
+      return true;
     default:
-      fprintf(stderr, "Unsupported RAM size: %02X\n", size_code);
-      abort();
+      return false;
   }
 }
 
+u32 Cartridge::get_checksum() const
+{
+  // Combine the header checksum and global checksum from the cartridge header
+  const u8 *data = rom->data();
+  return (rom->size() < 0x150) ? 0 :
+         (data[0x14d] << 16) | (data[0x14e] << 8) | data[0x14f];
+}
+
 void Cartridge::set_save_callback(MemoryBankController::SaveRAMCallback save_ram)
 {
-  mbc->save_ram_callback = save_ram;
+  // Mapped save files are written out by themselves
+  if (save_file)
+    return;
+
+  mbc->save_ram_callback = std::move(save_ram);
+}
+
+bool Cartridge::map_save_file(const std::string &path)
+{
+  // Games without RAM don't need a file
+  if (ram.empty())
+    return true;
+
+  save_file = SaveFile::open(path, ram.data(), ram.size());
+  if (!save_file)
+    return false;
+
+  mbc->move_ram(save_file->data());
+  // The game saving is a good time to write the file out
+  SaveFile *file = save_file.get();
+  mbc->save_ram_callback = [file](void *, uint) { file->flush_soon(); };
+  return true;
 }
@@ -5,6 +5,8 @@
 #include <vector>
 #include "types.h"
 #include "mbc.h"
+#include "rom_image.h"
+#include "save_file.h"
 
 class Gameboy;
 
@@ -12,32 +14,117 @@ class Cartridge
 {
   Gameboy &gb;
 
-  std::vector<u8> rom;
+  std::shared_ptr<const RomImage> rom;
   std::vector<u8> ram;
+  // Replaces ram when it's kept in a mapped file. Declared before mbc, which
+  // may save when it's destroyed.
+  std::unique_ptr<SaveFile> save_file;
   std::unique_ptr<MemoryBankController> mbc;
 
-  void init_mbc(uint type);
-  void init_rom(uint size_code);
-  void init_ram(uint size_code);
+  enum class MBCType
+  {
+    NONE,
+    MBC1,
+    MBC3,
+  } mbc_type = MBCType::NONE;
+
+  // Calls f with the MBC as its own type, so ROM and RAM accesses call it
+  // directly rather than through a virtual call
+  template <typename F>
+  decltype(auto) with_mbc(F f) const
+  {
+    switch (mbc_type)
+    {
+      case MBCType::MBC1:
+        return f(static_cast<MBC1 &>(*mbc));
+      case MBCType::MBC3:
+        return f(static_cast<MBC3 &>(*mbc));
+      case MBCType::NONE:
+      default:
+        return f(static_cast<NoMBC &>(*mbc));
+    }
+  }
+
+  // What the cartridge header says about the hardware on the cartridge
+  struct Header
+  {
+    u8 cgb_flag;
+    MBCType mbc_type;
+    uint rom_size;
+    uint ram_size;
+  };
+  // Returns false, saying why, if the cartridge isn't one which is supported
+  static bool read_header(const RomImage &rom_image, Header &header);
+  static bool mbc_type_for(uint type, MBCType &mbc_type);
+  static bool rom_size(uint size_code, uint &size);
+  static bool ram_size(uint size_code, uint &size);
+
+  void init_mbc(uint size);
 
 public:
   explicit Cartridge(Gameboy &gb_) : gb(gb_) { }
 
-  void init_cartridge(std::istream& rom_stream, std::istream& ram_stream);
+  // Checks whether a ROM can be loaded, as loading one which can't be aborts
+  static bool is_supported(const RomImage &rom_image);
+
+  void init_cartridge(std::shared_ptr<const RomImage> rom_image, std::istream& ram_stream);
   void set_save_callback(MemoryBankController::SaveRAMCallback save_ram);
+  bool map_save_file(const std::string &path);
 
   u8 get8(uint address) const
   {
-    return mbc->get8(address);
+    return with_mbc([=](const auto &m) { return m.get8(address); });
   }
 
   void set8(uint address, u8 value)
   {
-    mbc->set8(address, value);
+    uint offset = with_mbc([=](auto &m) { return m.set8(address, value); });
+    if (save_file && offset != MemoryBankController::no_ram_write)
+    {
+      save_file->mark_dirty(offset, 1);
+    }
+  }
+
+  const u8 *rom_bank0() const
+  {
+    return rom->data();
+  }
+
+  const u8 *rom_bank() const
+  {
+    return with_mbc([](const auto &m) { return m.rom_bank(); });
+  }
+
+  u8 *ram_bank()
+  {
+    u8 *bank = with_mbc([](auto &m) { return m.ram_bank(); });
+    if (save_file)
+    {
+      // Memory writes straight to the bank from now on
+      save_file->set_writable(bank ? bank - save_file->data() : 0, bank ? 0x2000 : 0);
+    }
+    return bank;
   }
 
   void save()
   {
     mbc->save();
   }
+
+  // Identifies the loaded ROM, so save states can't be restored into another game
+  u32 get_checksum() const;
+
+  void save_state(StateWriter &state) const
+  {
+    with_mbc([&](const auto &m) { m.save_state(state); });
+  }
+
+  void load_state(StateReader &state)
+  {
+    with_mbc([&](auto &m) { m.load_state(state); });
+    if (save_file)
+    {
+      save_file->mark_dirty(0, save_file->size());
+    }
+  }
 };
@@ -1,8 +1,12 @@
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 
 #include "display.h"
 #include "lr35902.h"
 #include "memory.h"
+#include "scheduler.h"
+#include "state.h"
 
 void Display::update(uint cycles)
 {
@@ -10,13 +14,28 @@ void Display::update(uint cycles)
 
   if (LCDC & (1<<7)) // LCD enabled?
   {
+    u8 scanline = memory.get8(Memory::IO::LY);
+    int previous_counter = scanline_counter;
     scanline_counter -= cycles;
 
+    // Modes within a line only matter to the CPU when it reads STAT, which
+    // works them out then, or when they raise an interrupt
+    if (previous_counter > hblank_start && scanline_counter <= hblank_start &&
+        get_mode(scanline) == MODE::HBLANK)
+    {
+      raise_mode_interrupt(MODE::HBLANK);
+      if (scanline < 144)
+      {
+        memory.hblank_dma();
+      }
+    }
+
     if (scanline_counter <= 0)
     {
+      MODE::Mode previous_mode = get_mode(scanline);
       scanline_counter += cycles_per_scanline;
 
-      u8 scanline = memory.get8(Memory::IO::LY) + 1;
+      scanline++;
       if (scanline > 153)
       {
         scanline = 0;
@@ -32,182 +51,235 @@ void Display::update(uint cycles)
       {
         cpu.raise_interrupt(LR35902::Interrupt::VBLANK);
         vblank = true;
+        front_buffer.swap(back_buffer);
+        front_changed = back_changed;
+        back_changed.set();
+      }
+
+      MODE::Mode mode = get_mode(scanline);
+      if (mode != previous_mode)
+      {
+        raise_mode_interrupt(mode);
       }
     }
 
-    update_status(); // put at beginning?
+    check_coincidence();
   }
 }
 
-void Display::draw_scanline()
+uint Display::cycles_until_update() const
 {
   u8 LCDC = memory.get8(Memory::IO::LCDC);
-
-  if (gb_version == GB_VERSION::COLOUR || LCDC & (1<<0))
+  if (!(LCDC & (1<<7)))
   {
-    draw_background();
+    // Nothing happens until the LCD is enabled again
+    return Scheduler::no_event;
   }
-  else
-  {
-    clear_background();
-  }
-  if (LCDC & (1<<5))
+
+  // Update at the start of HBlank if it raises an interrupt or a DMA is
+  // waiting for it, otherwise only at the start of the next line
+  if (((stat & (1<<3)) || memory.hblank_dma_active()) && scanline_counter > hblank_start)
   {
-    draw_window();
+    return scanline_counter - hblank_start;
   }
-  if (LCDC & (1<<1))
+  else if (scanline_counter > 0)
   {
-    draw_sprites();
+    return scanline_counter;
   }
+  return 1;
 }
 
-void Display::draw_background()
+void Display::draw_scanline()
 {
   u8 LCDC = memory.get8(Memory::IO::LCDC);
   u8 LY   = memory.get8(Memory::IO::LY);
 
-  uint base_tile_map_addr;
-  if (LCDC & (1<<3))
+  if (gb_version == GB_VERSION::ORIGINAL)
   {
-    // 0x9C00 - 9FFF
-    base_tile_map_addr = 0x9C00;
-  }
-  else
-  {
-    // 0x9800 - 9BFF
-    base_tile_map_addr = 0x9800;
+    decode_background_palette();
   }
 
-  uint base_tile_data_addr;
-  bool signed_pattern_numbers;
-  if (LCDC & (1<<4))
+  if (gb_version == GB_VERSION::COLOUR || LCDC & (1<<0))
   {
-    // 0x8000 - 0x8FFF
-    // Offsets will be unsigned
-    base_tile_data_addr = 0x8000;
-    signed_pattern_numbers = false;
+    draw_background();
   }
   else
   {
-    // 0x8800 - 0x97FF
-    // Offsets will be signed, set addr to middle of range
-    base_tile_data_addr = 0x9000;
-    signed_pattern_numbers = true;
+    clear_background();
   }
-
-  u8 SCY = memory.get8(Memory::IO::SCY);
-  u8 SCX = memory.get8(Memory::IO::SCX);
-
-  uint background_y = (SCY + LY)%256;
-  uint tile_row = background_y/8;
-  uint tile_y = background_y%8;
-
-  for (uint screenx=0; screenx<width; screenx++)
+  if (LCDC & (1<<5))
   {
-    uint background_x = (SCX + screenx)%256;
-    uint tile_col = background_x/8;
-    uint tile_x = background_x%8;
+    draw_window();
+  }
 
-    // Tile map is 32x32 tiles, with 1 byte per tile
-    uint tile_map_addr = base_tile_map_addr + tile_row*32 + tile_col;
-    u8 tile_num = memory.get8(tile_map_addr, 0);
+  if (LCDC & (1<<1))
+  {
+    draw_sprites();
+  }
 
-    u8 tile_attr;
-    uint vram_bank;
-    bool high_priority;
-    if (gb_version == GB_VERSION::ORIGINAL)
-    {
-      vram_bank = 0;
-      high_priority = false;
-    }
-    else
-    {
-      // Tile map attributes defines attributes for the corresponding tile number
-      tile_attr = memory.get8(tile_map_addr, 1);
+  write_line(LY);
+}
 
-      vram_bank     = (tile_attr >> 3) & 0x1;
-      bool flip_x   = (tile_attr >> 5) & 0x1;
-      bool flip_y   = (tile_attr >> 6) & 0x1;
-      high_priority = (tile_attr >> 7) & 0x1;
+void Display::write_line(u8 LY)
+{
+  const Colour *in = &scanline[scanline_padding];
+  u8 *out = &back_buffer[LY * pitch];
 
-      if (!(LCDC & (1<<0))) // master priority
+  switch (pixel_format)
+  {
+    case PixelFormat::RGB888:
+      memcpy(out, in, width * sizeof(Colour));
+      break;
+    case PixelFormat::RGBA8888:
+      for (uint x=0; x<width; x++, out+=4)
       {
-        high_priority = false;
+        out[0] = in[x].r;
+        out[1] = in[x].g;
+        out[2] = in[x].b;
+        out[3] = 0xff;
       }
-      if (flip_y)
+      break;
+    case PixelFormat::RGB565:
+      for (uint x=0; x<width; x++)
       {
-        tile_y = 8 - tile_y;
+        u16 pixel = (in[x].r >> 3) << 11 | (in[x].g >> 2) << 5 | in[x].b >> 3;
+        memcpy(out + x*2, &pixel, sizeof(pixel));
       }
-      if (flip_x)
+      break;
+    case PixelFormat::INDEXED2:
+      // Shades come from brightness, which gives back exactly the shades
+      // the original Gameboy's palette registers chose
+      memset(out, 0, width / 4);
+      for (uint x=0; x<width; x++)
       {
-        tile_x = 8 - tile_x;
+        uint luma = (in[x].r*77 + in[x].g*150 + in[x].b*29) >> 8;
+        out[x/4] |= (3 - (luma >> 6)) << ((x%4) * 2);
       }
-    }
+      break;
+    default:
+      abort();
+  }
 
+  // The front buffer still holds the frame before this one
+  back_changed[LY] = memcmp(&back_buffer[LY * pitch], &front_buffer[LY * pitch], pitch) != 0;
+}
 
-    // Tile data is 32x32 tiles, with 16 bytes per tile
-    uint tile_data_addr;
-    if (signed_pattern_numbers)
-    {
-      tile_data_addr = base_tile_data_addr + ((s8)tile_num)*16;
-    }
-    else
-    {
-      tile_data_addr = base_tile_data_addr + ((u8)tile_num)*16;
-    }
+void Display::set_pixel_format(PixelFormat format)
+{
+  switch (format)
+  {
+    case PixelFormat::RGB888:
+      pitch = width * 3;
+      break;
+    case PixelFormat::RGBA8888:
+      pitch = width * 4;
+      break;
+    case PixelFormat::RGB565:
+      pitch = width * 2;
+      break;
+    case PixelFormat::INDEXED2:
+      pitch = width / 4;
+      break;
+    default:
+      abort();
+  }
 
-    // Tiles are 8x8 pixels, with 2 bits per pixel
-    // i.e 2 bytes per line and 4 pixels per byte
-    //   The 2 bits per pixel aren't adjacent, they are in the
-    //   same position in each of the 2 bytes for their line.
-    uint tile_byte_offset = tile_y*2;
-    u8 tile_byte1 = memory.get8(tile_data_addr + tile_byte_offset, vram_bank);
-    u8 tile_byte2 = memory.get8(tile_data_addr + tile_byte_offset + 1, vram_bank);
+  pixel_format = format;
+  front_buffer.assign(height * pitch, 0);
+  back_buffer.assign(height * pitch, 0);
+  front_changed.set();
+  back_changed.set();
+}
 
-    uint bit = 7 - tile_x;
-    uint colour_id = ((tile_byte1 >> bit) & 0x1) |
-                     ((tile_byte2 >> bit) & 0x1) << 1;
+void Display::decode_background_palette()
+{
+  // Get the colours from the background palette register
+  // 0 = white, 3 = black
+  u8 BGP = memory.get8(Memory::IO::BGP);
+  for (uint i=0; i<4; i++)
+  {
+    background_palette[i] = display_palette[(BGP >> (i*2)) & 0x3];
+  }
+}
 
-    Colour colour;
-    if (gb_version == GB_VERSION::ORIGINAL)
-    {
-      // Get the colour from the background palette register
-      // 0 = white, 3 = black
-      u8 BGP = memory.get8(Memory::IO::BGP);
-      u8 palette_colour = (BGP >> (colour_id * 2)) & 0x3;
-      colour = display_palette[palette_colour];
-    }
-    else
-    {
-      u8 palette_num   = (tile_attr >> 0) & 0x7;
-      uint palette_offset = palette_num*8; // palettes are 8 bytes each
+// Convert colour number index (0 - 31) from a set of 8 Gameboy Colour palettes
+Display::Colour Display::decode_cgb_colour(const std::vector<u8> &palettes, uint index) const
+{
+  // 2 bytes per colour, 5 bits per channel
+  u8 colour_byte1 = palettes[index*2];
+  u8 colour_byte2 = palettes[index*2 + 1];
+  u16 c = colour_byte2 << 8 | colour_byte1;
 
-      Colour cgb_display_palette[4];
-      for (uint i=0; i<4; i++)
-      {
-        u8 colour_byte1 = cgb_background_palettes.at(palette_offset + i*2);
-        u8 colour_byte2 = cgb_background_palettes.at(palette_offset + i*2 + 1);
-        u16 c = colour_byte2 << 8 | colour_byte1;
+  uint r = (c >> 0) & 0x1f;
+  uint g = (c >> 5) & 0x1f;
+  uint b = (c >>10) & 0x1f;
 
-        cgb_display_palette[i] = {.r = (u8)((c >> 0) & 0x1f),
-                                  .g = (u8)((c >> 5) & 0x1f),
-                                  .b = (u8)((c >>10) & 0x1f)};
-      }
+  if (colour_correction)
+  {
+    // The Gameboy Colour's screen mixes the channels together a little and
+    // never gets fully bright
+    return {.r = (u8)(std::min(r*26 + g*4 + b*2, 960u) >> 2),
+            .g = (u8)(std::min(g*24 + b*8, 960u) >> 2),
+            .b = (u8)(std::min(r*6 + g*4 + b*22, 960u) >> 2)};
+  }
+
+  // Scale 5 bit channels up to 8 bits, so 0x1f becomes 0xff
+  return {.r = (u8)(r << 3 | r >> 2),
+          .g = (u8)(g << 3 | g >> 2),
+          .b = (u8)(b << 3 | b >> 2)};
+}
 
-      colour = cgb_display_palette[colour_id];
+void Display::decode_cgb_palettes()
+{
+  for (uint palette=0; palette<8; palette++)
+  {
+    for (uint i=0; i<4; i++)
+    {
+      cgb_background_colours[palette][i] = decode_cgb_colour(cgb_background_palettes, palette*4 + i);
+      cgb_sprite_colours[palette][i] = decode_cgb_colour(cgb_sprite_palettes, palette*4 + i);
     }
+  }
+}
 
-    // TODO priority tiles
-    framebuffer[LY][screenx] = colour;
+void Display::set_colour_correction(bool correct)
+{
+  colour_correction = correct;
+  decode_cgb_palettes();
+}
+
+void Display::draw_background()
+{
+  u8 LCDC = memory.get8(Memory::IO::LCDC);
+  u8 LY   = memory.get8(Memory::IO::LY);
+  u8 SCY  = memory.get8(Memory::IO::SCY);
+  u8 SCX  = memory.get8(Memory::IO::SCX);
+
+  uint base_tile_map_addr;
+  if (LCDC & (1<<3))
+  {
+    // 0x9C00 - 9FFF
+    base_tile_map_addr = 0x9C00;
   }
+  else
+  {
+    // 0x9800 - 9BFF
+    base_tile_map_addr = 0x9800;
+  }
+
+  uint background_y = (SCY + LY)%256;
+  uint tile_row = background_y/8;
+  uint tile_y = background_y%8;
+
+  // The first tile starts off the left of the screen unless SCX is a
+  // multiple of 8
+  draw_tiles(base_tile_map_addr + tile_row*32, SCX/8, tile_y, -(SCX%8));
 }
 
 void Display::clear_background()
 {
-  u8 LY = memory.get8(Memory::IO::LY);
   for (uint screenx=0; screenx<width; screenx++)
   {
-    framebuffer[LY][screenx] = display_palette[0]; // white
+    scanline[scanline_padding + screenx] = display_palette[0]; // white
   }
 }
 
@@ -236,126 +308,120 @@ void Display::draw_window()
     base_window_map_addr = 0x9800;
   }
 
-  uint base_tile_data_addr;
-  bool signed_pattern_numbers;
-  if (LCDC & (1<<4))
-  {
-    // 0x8000 - 0x8FFF
-    // Offsets will be unsigned
-    base_tile_data_addr = 0x8000;
-    signed_pattern_numbers = false;
-  }
-  else
-  {
-    // 0x8800 - 0x97FF
-    // Offsets will be signed, set addr to middle of range
-    base_tile_data_addr = 0x9000;
-    signed_pattern_numbers = true;
-  }
-
-  uint window_y = (LY - WY)%256;
+  uint window_y = LY - WY;
   uint tile_row = window_y/8;
   uint tile_y = window_y%8;
 
-  // Set WX to left side of window
-  WX -= 7;
+  // WX is the left side of the window + 7, and the window covers the
+  // background from there to the end of the line
+  draw_tiles(base_window_map_addr + tile_row*32, 0, tile_y, WX - 7);
+}
 
-  for (uint screenx=0; screenx<width; screenx++)
-  {
-    uint window_x = (screenx - WX)%256;
-    uint tile_col = window_x/8;
-    uint tile_x = window_x%8;
+// Tiles are 8x8 pixels, with 2 bits per pixel, stored as 2 bytes per line.
+// The 2 bits for each pixel aren't adjacent - they are in the same position
+// in each of the 2 bytes, with the leftmost pixel in bit 7.
+//
+// These tables spread out the bits of one of the bytes so the colour numbers
+// for a whole line of a tile can be found with two lookups. The leftmost
+// pixel ends up in the lowest 2 bits.
+namespace {
 
-    // Tile map is 32x32 tiles, with 1 byte per tile
-    uint tile_map_addr = base_window_map_addr + tile_row*32 + tile_col;
-    u8 tile_num = memory.get8(tile_map_addr, 0);
+struct TileLineTable
+{
+  u16 spread[256];
+};
 
-    u8 tile_attr;
-    uint vram_bank;
-    bool high_priority;
-    if (gb_version == GB_VERSION::ORIGINAL)
+constexpr TileLineTable make_tile_line_table(bool flip_x)
+{
+  TileLineTable table = {};
+  for (uint byte=0; byte<256; byte++)
+  {
+    uint spread = 0;
+    for (uint pixel=0; pixel<8; pixel++)
     {
-      vram_bank = 0;
-      high_priority = false;
+      uint bit = flip_x ? pixel : 7 - pixel;
+      spread |= ((byte >> bit) & 0x1) << (pixel*2);
     }
-    else
-    {
-      // Tile map attributes defines attributes for the corresponding tile number
-      tile_attr = memory.get8(tile_map_addr, 1);
+    table.spread[byte] = spread;
+  }
+  return table;
+}
 
-      vram_bank     = (tile_attr >> 3) & 0x1;
-      bool flip_x   = (tile_attr >> 5) & 0x1;
-      bool flip_y   = (tile_attr >> 6) & 0x1;
-      high_priority = (tile_attr >> 7) & 0x1;
+constexpr TileLineTable tile_line = make_tile_line_table(false);
+constexpr TileLineTable tile_line_flipped = make_tile_line_table(true);
 
-      if (!(LCDC & (1<<0))) // master priority
-      {
-        high_priority = false;
-      }
-      if (flip_y)
-      {
-        tile_y = 8 - tile_y;
-      }
-      if (flip_x)
-      {
-        tile_x = 8 - tile_x;
-      }
-    }
+inline uint decode_tile_line(u8 tile_byte1, u8 tile_byte2, bool flip_x)
+{
+  const TileLineTable &table = flip_x ? tile_line_flipped : tile_line;
+  return table.spread[tile_byte1] | (table.spread[tile_byte2] << 1);
+}
+
+}  // namespace
+
+// Draw a row of tiles from the tile map at tile_map_addr into the scanline,
+// starting with column tile_col at screen position x and continuing to the
+// end of the line. tile_y is the line within the tiles to draw.
+void Display::draw_tiles(uint tile_map_addr, uint tile_col, uint tile_y, int x)
+{
+  u8 LCDC = memory.get8(Memory::IO::LCDC);
+
+  const u8 *vram[2] = {memory.get_vram(0), memory.get_vram(1)};
+
+  // Tile map is 32x32 tiles, with 1 byte per tile. On the Gameboy Colour,
+  // VRAM bank 1 holds each tile's attributes in the same position.
+  const u8 *tile_map = vram[0] + tile_map_addr - 0x8000;
+  const u8 *tile_attrs = vram[1] + tile_map_addr - 0x8000;
+
+  for (; x<(int)width; x+=8, tile_col=(tile_col+1)%32)
+  {
+    u8 tile_num = tile_map[tile_col];
 
-    // Tile data is 32x32 tiles, with 16 bytes per tile
-    uint tile_data_addr;
-    if (signed_pattern_numbers)
+    // Tile data is 16 bytes per tile, either at 0x8000 - 0x8FFF with unsigned
+    // tile numbers or 0x8800 - 0x97FF with signed tile numbers
+    uint tile_data_offset;
+    if (LCDC & (1<<4))
     {
-      tile_data_addr = base_tile_data_addr + ((s8)tile_num)*16;
+      tile_data_offset = tile_num*16;
     }
     else
     {
-      tile_data_addr = base_tile_data_addr + ((u8)tile_num)*16;
+      tile_data_offset = 0x1000 + ((s8)tile_num)*16;
     }
 
-    // Tiles are 8x8 pixels, with 2 bits per pixel
-    // i.e 2 bytes per line and 4 pixels per byte
-    //   The 2 bits per pixel aren't adjacent, they are in the
-    //   same position in each of the 2 bytes for their line.
-    uint tile_byte_offset = tile_y*2;
-    u8 tile_byte1 = memory.get8(tile_data_addr + tile_byte_offset, vram_bank);
-    u8 tile_byte2 = memory.get8(tile_data_addr + tile_byte_offset + 1, vram_bank);
-
-    uint bit = 7 - tile_x;
-    uint colour_id = ((tile_byte1 >> bit) & 0x1) |
-                     ((tile_byte2 >> bit) & 0x1) << 1;
-
-    Colour colour;
+    const Colour *palette;
+    uint vram_bank;
+    uint line = tile_y;
+    bool flip_x;
     if (gb_version == GB_VERSION::ORIGINAL)
     {
-      // Get the colour from the background palette register
-      // 0 = white, 3 = black
-      u8 BGP = memory.get8(Memory::IO::BGP);
-      u8 palette_colour = (BGP >> (colour_id * 2)) & 0x3;
-      colour = display_palette[palette_colour];
+      palette = background_palette;
+      vram_bank = 0;
+      flip_x = false;
     }
     else
     {
-      u8 palette_num   = (tile_attr >> 0) & 0x7;
-      uint palette_offset = palette_num*8; // palettes are 8 bytes each
+      u8 tile_attr = tile_attrs[tile_col];
 
-      Colour cgb_display_palette[4];
-      for (uint i=0; i<4; i++)
-      {
-        u8 colour_byte1 = cgb_background_palettes.at(palette_offset + i*2);
-        u8 colour_byte2 = cgb_background_palettes.at(palette_offset + i*2 + 1);
-        u16 c = colour_byte2 << 8 | colour_byte1;
+      palette     = cgb_background_colours[tile_attr & 0x7];
+      vram_bank   = (tile_attr >> 3) & 0x1;
+      flip_x      = (tile_attr >> 5) & 0x1;
+      bool flip_y = (tile_attr >> 6) & 0x1;
 
-        cgb_display_palette[i] = {.r = (u8)((c >> 0) & 0x1f),
-                                  .g = (u8)((c >> 5) & 0x1f),
-                                  .b = (u8)((c >>10) & 0x1f)};
+      if (flip_y)
+      {
+        line = 7 - tile_y;
       }
-
-      colour = cgb_display_palette[colour_id];
     }
 
     // TODO priority tiles
-    framebuffer[LY][screenx] = colour;
+    const u8 *tile_data = vram[vram_bank] + tile_data_offset + line*2;
+    uint colour_ids = decode_tile_line(tile_data[0], tile_data[1], flip_x);
+
+    Colour *out = &scanline[scanline_padding + x];
+    for (uint pixel=0; pixel<8; pixel++)
+    {
+      out[pixel] = palette[(colour_ids >> (pixel*2)) & 0x3];
+    }
   }
 }
 
@@ -410,7 +476,7 @@ void Display::draw_sprites()
     uint sprite_y = LY - y_pos + 16;
     if (flip_y)
     {
-      sprite_y = sprite_height - sprite_y;
+      sprite_y = sprite_height - 1 - sprite_y;
     }
 
     uint vram_bank;
@@ -426,6 +492,37 @@ void Display::draw_sprites()
     uint sprite_byte_offset = sprite_y*2;
     u8 sprite_byte1 = memory.get8(sprite_data_addr + sprite_byte_offset, vram_bank);
     u8 sprite_byte2 = memory.get8(sprite_data_addr + sprite_byte_offset + 1, vram_bank);
+    uint colour_ids = decode_tile_line(sprite_byte1, sprite_byte2, flip_x);
+
+    Colour dmg_palette[4];
+    const Colour *palette;
+    Colour colour_0;
+    if (gb_version == GB_VERSION::ORIGINAL)
+    {
+      // Get the colours from the sprite palette register
+      // 0 = white, 3 = black
+      u8 OBP;
+      if (palette_num == 0)
+      {
+        OBP = memory.get8(Memory::IO::OBP0);
+      }
+      else
+      {
+        OBP = memory.get8(Memory::IO::OBP1);
+      }
+      for (uint i=0; i<4; i++)
+      {
+        dmg_palette[i] = display_palette[(OBP >> (i*2)) & 0x3];
+      }
+
+      palette = dmg_palette;
+      colour_0 = background_palette[0];
+    }
+    else
+    {
+      palette = cgb_sprite_colours[flags & 0x7];
+      colour_0 = palette[0];
+    }
 
     for (uint sprite_x=0; sprite_x<8; sprite_x++)
     {
@@ -436,129 +533,132 @@ void Display::draw_sprites()
         continue;
       }
 
-      uint bit = flip_x ? sprite_x : 7 - sprite_x;
-      uint colour_id = ((sprite_byte1 >> bit) & 0x1) |
-                       ((sprite_byte2 >> bit) & 0x1) << 1;
-
+      uint colour_id = (colour_ids >> (sprite_x*2)) & 0x3;
       if (colour_id == 0) // Colour 0 is transparent
       {
         continue;
       }
 
-      Colour colour;
-      Colour colour_0;
-      if (gb_version == GB_VERSION::ORIGINAL)
-      {
-        // Get the colour from the background palette register
-        // 0 = white, 3 = black
-        u8 palette;
-        if (palette_num == 0)
-        {
-          palette = memory.get8(Memory::IO::OBP0);
-        }
-        else
-        {
-          palette = memory.get8(Memory::IO::OBP1);
-        }
-        u8 palette_colour = (palette >> (colour_id * 2)) & 0x3;
-        colour = display_palette[palette_colour];
-
-        u8 BGP = memory.get8(Memory::IO::BGP);
-        u8 palette_colour_0 = (BGP & 0x3);
-        colour_0 = display_palette[palette_colour_0];
-      }
-      else
-      {
-        palette_num = flags & 0x7;
-        uint palette_offset = palette_num*8; // palettes are 8 bytes each
-
-        Colour cgb_display_palette[4];
-        for (uint i=0; i<4; i++)
-        {
-          u8 colour_byte1 = cgb_sprite_palettes.at(palette_offset + i*2);
-          u8 colour_byte2 = cgb_sprite_palettes.at(palette_offset + i*2 + 1);
-          u16 c = colour_byte2 << 8 | colour_byte1;
-
-          cgb_display_palette[i] = {.r = (u8)((c >> 0) & 0x1f),
-                                    .g = (u8)((c >> 5) & 0x1f),
-                                    .b = (u8)((c >>10) & 0x1f)};
-        }
-
-        colour_0 = cgb_display_palette[0];
-        colour = cgb_display_palette[colour_id];
-      }
-
       // Low priority sprites are only drawn on colour 0 backgrounds
+      Colour &out = scanline[scanline_padding + screenx];
       if (!low_priority ||
-          (framebuffer[LY][screenx].r == colour_0.r &&
-           framebuffer[LY][screenx].b == colour_0.b &&
-           framebuffer[LY][screenx].g == colour_0.g))
+          (out.r == colour_0.r &&
+           out.b == colour_0.b &&
+           out.g == colour_0.g))
       {
-        framebuffer[LY][screenx] = colour;
+        out = palette[colour_id];
       }
     }
   }
 }
 
-void Display::update_status()
+Display::MODE::Mode Display::get_mode(u8 scanline) const
 {
-  u8 STAT = memory.get8(Memory::IO::STAT);
-
-  u8 scanline = memory.get8(Memory::IO::LY);
-  MODE::Mode mode;
-
   if (scanline > 144)
   {
-    mode = MODE::VBLANK;
+    return MODE::VBLANK;
   }
-  else if (scanline_counter > cycles_per_scanline - 80)
+  else if (scanline_counter > cycles_per_scanline - oam_cycles)
   {
-    mode = MODE::OAM;
+    return MODE::OAM;
   }
-  else if (scanline_counter > cycles_per_scanline - 80 - 172)
+  else if (scanline_counter > hblank_start)
   {
-    mode = MODE::VRAM;
+    return MODE::VRAM;
   }
-  else
+  return MODE::HBLANK;
+}
+
+void Display::raise_mode_interrupt(MODE::Mode mode)
+{
+  if (mode != MODE::VRAM && (stat >> (mode + 3)) & 0x1)
   {
-    mode = MODE::HBLANK;
+    cpu.raise_interrupt(LR35902::Interrupt::LCD);
   }
+}
+
+void Display::check_coincidence()
+{
+  bool match = (memory.get8(Memory::IO::LY) == lyc);
 
-  const MODE::Mode current_mode = static_cast<MODE::Mode>(STAT & 0x3);
-  if (current_mode != mode &&
-      mode != MODE::VRAM &&
-      (STAT >> (mode + 3)) & 0x1)
+  // Only interrupt when the coincidence flag is first set
+  if (match && !coincidence && (stat >> 6) & 0x1)
   {
     cpu.raise_interrupt(LR35902::Interrupt::LCD);
   }
+  coincidence = match;
+}
 
-  // Update mode
-  STAT &= ~0x3;
-  STAT |= mode;
-
-  const u8 LYC = memory.get8(Memory::IO::LYC);
-  if (LYC == scanline)
+void Display::save_state(StateWriter &state, bool framebuffer) const
+{
+  if (framebuffer)
   {
-    // Set coincidence flag
-    STAT |= (1<<2);
-    if ((STAT >> 6) & 0x1)
-    {
-      cpu.raise_interrupt(LR35902::Interrupt::LCD);
-    }
+    state.write(front_buffer);
+    state.write(back_buffer);
   }
   else
   {
-    // Clear coincidence flag
-    STAT &= ~(1<<2);
+    // Between frames, the next frame's first line has already been drawn
+    state.write(&back_buffer[0], pitch);
   }
+  state.write(scanline_counter);
+  state.write(vblank);
+  state.write(stat);
+  state.write(lyc);
+  state.write(coincidence);
+  state.write(cgb_background_palettes);
+  state.write(cgb_sprite_palettes);
+  state.write(cgb_background_palette_index);
+  state.write(cgb_sprite_palette_index);
+  state.write(cgb_background_palette_autoinc);
+  state.write(cgb_sprite_palette_autoinc);
+}
 
-  memory.set8(Memory::IO::STAT, STAT);
+void Display::load_state(StateReader &state, bool framebuffer)
+{
+  if (framebuffer)
+  {
+    state.read(front_buffer);
+    state.read(back_buffer);
+    front_changed.set();
+    back_changed.set();
+  }
+  else
+  {
+    state.read(&back_buffer[0], pitch);
+    back_changed[0] = memcmp(&back_buffer[0], &front_buffer[0], pitch) != 0;
+  }
+  state.read(scanline_counter);
+  state.read(vblank);
+  state.read(stat);
+  state.read(lyc);
+  state.read(coincidence);
+  state.read(cgb_background_palettes);
+  state.read(cgb_sprite_palettes);
+  state.read(cgb_background_palette_index);
+  state.read(cgb_sprite_palette_index);
+  state.read(cgb_background_palette_autoinc);
+  state.read(cgb_sprite_palette_autoinc);
+
+  cgb_background_palette_index &= 0x3f;
+  cgb_sprite_palette_index &= 0x3f;
+
+  decode_cgb_palettes();
 }
 
 u8 Display::read_byte(uint address) const
 {
   switch (address)
   {
+    case Memory::IO::STAT:
+    {
+      // Mode is reported as 0 while the LCD is off
+      u8 LCDC = memory.get8(Memory::IO::LCDC);
+      u8 mode = (LCDC & (1<<7)) ? get_mode(memory.get8(Memory::IO::LY)) : 0;
+      return (stat & ~0x7) | (coincidence << 2) | mode;
+    }
+    case Memory::IO::LYC:
+      return lyc;
     case Memory::IO::BGPD:
       return cgb_background_palettes[cgb_background_palette_index];
     case Memory::IO::OBPD:
@@ -572,19 +672,53 @@ u8 Display::read_byte(uint address) const
   }
 }
 
+uint Display::cycles_until_change(uint address) const
+{
+  u8 LCDC = memory.get8(Memory::IO::LCDC);
+  if (address != Memory::IO::STAT || !(LCDC & (1<<7)))
+  {
+    return Memory::always_stable;
+  }
+
+  // STAT's mode and coincidence flag can change at the next mode or line
+  if (scanline_counter > cycles_per_scanline - oam_cycles)
+  {
+    return scanline_counter - (cycles_per_scanline - oam_cycles);
+  }
+  else if (scanline_counter > hblank_start)
+  {
+    return scanline_counter - hblank_start;
+  }
+  return scanline_counter > 0 ? scanline_counter : 1;
+}
+
 void Display::write_byte(uint address, u8 value)
 {
   switch (address)
   {
+    case Memory::IO::STAT:
+      // The coincidence flag is read only, so the bit written is ignored and
+      // a match which is still ongoing doesn't interrupt again
+      stat = value;
+      check_coincidence();
+      break;
+    case Memory::IO::LYC:
+      lyc = value;
+      check_coincidence();
+      break;
     case Memory::IO::BGPD:
       cgb_background_palettes[cgb_background_palette_index] = value;
+      cgb_background_colours[cgb_background_palette_index/8][(cgb_background_palette_index/2)%4] =
+        decode_cgb_colour(cgb_background_palettes, cgb_background_palette_index/2);
       if (cgb_background_palette_autoinc)
-        cgb_background_palette_index++;
+        cgb_background_palette_index = (cgb_background_palette_index + 1) & 0x3f;
       break;
     case Memory::IO::OBPD:
       cgb_sprite_palettes[cgb_sprite_palette_index] = value;
+      cgb_sprite_colours[cgb_sprite_palette_index/8][(cgb_sprite_palette_index/2)%4] =
+        decode_cgb_colour(cgb_sprite_palettes, cgb_sprite_palette_index/2);
       if (cgb_sprite_palette_autoinc)
-        cgb_sprite_palette_index++;
+        cgb_sprite_palette_index = (cgb_sprite_palette_index + 1) & 0x3f;
       break;
     case Memory::IO::BGPI:
       cgb_background_palette_index = value & 0x3f;
@@ -1,10 +1,13 @@
 #pragma once
 
+#include <bitset>
 #include <vector>
 #include "types.h"
 
 class LR35902;
 class Memory;
+class StateWriter;
+class StateReader;
 
 class Display
 {
@@ -26,6 +29,16 @@ public:
     u8 r, g, b;
   };
 
+  // How finished frames are laid out. Rows are packed with no padding.
+  enum class PixelFormat
+  {
+    RGB888,   // 3 bytes per pixel: r, g, b
+    RGBA8888, // 4 bytes per pixel: r, g, b, 0xff
+    RGB565,   // A native endian u16 per pixel, red in the top 5 bits
+    INDEXED2, // 2 bits per pixel, 0 (lightest) to 3 (darkest), packed 4 to
+              // a byte with the leftmost pixel in the lowest bits
+  };
+
   Colour display_palette[4] = {
                                {0xff, 0xff, 0xff},
                                {0xaa, 0xaa, 0xaa},
@@ -34,25 +47,69 @@ public:
                               };
 
   void update(uint cycles);
-  const Colour *get_framebuffer() const { return &framebuffer[0][0]; }
+  uint cycles_until_update() const;
+
+  // Frames are drawn into a back buffer, which is swapped with the front
+  // buffer at the start of VBlank, so the front buffer always holds the
+  // last whole frame. Changing format clears both buffers.
+  void set_pixel_format(PixelFormat format);
+  PixelFormat get_pixel_format() const { return pixel_format; }
+  const u8 *get_framebuffer() const { return front_buffer.data(); }
+  uint get_framebuffer_pitch() const { return pitch; }
+  size_t get_framebuffer_size() const { return front_buffer.size(); }
+
+  // Lines of the front buffer which differ from the frame before it. Lines
+  // which weren't drawn, and every line after a format change or loading a
+  // state, count as changed.
+  using LineSet = std::bitset<height>;
+  const LineSet &get_changed_lines() const { return front_changed; }
   bool in_vblank() { return vblank; }
 
+  // Adjust Gameboy Colour colours to look more like they did on its screen
+  void set_colour_correction(bool correct);
+
   u8 read_byte(uint address) const;
+  uint cycles_until_change(uint address) const;
   void write_byte(uint address, u8 value);
 
+  void save_state(StateWriter &state, bool framebuffer) const;
+  void load_state(StateReader &state, bool framebuffer);
+
 private:
   LR35902 &cpu;
   Memory &memory;
 
-  Colour framebuffer[height][width];
+  PixelFormat pixel_format = PixelFormat::RGB888;
+  uint pitch = width * sizeof(Colour);
+  std::vector<u8> front_buffer = std::vector<u8>(height * pitch);
+  std::vector<u8> back_buffer = std::vector<u8>(height * pitch);
+  LineSet front_changed = LineSet().set();
+  LineSet back_changed = LineSet().set();
+
+  // Each line is drawn here first, then converted into the back buffer. There's
+  // room either side for tiles which are partly off screen.
+  static const uint scanline_padding = 8;
+  Colour scanline[scanline_padding + width + scanline_padding];
+
+  // Original Gameboy background palette, decoded at the start of each line
+  Colour background_palette[4];
 
   static const int cycles_per_scanline = 456;
+  static const int oam_cycles  = 80;  // Cycles spent in mode 2 (OAM search)
+  static const int vram_cycles = 172; // Cycles spent in mode 3 (VRAM read)
+  static const int hblank_start = cycles_per_scanline - oam_cycles - vram_cycles;
 
   // Numer of cycles remaining until we move on to the next scanline
   int scanline_counter = 456;
 
   bool vblank = false;
 
+  // STAT's interrupt enable bits and LYC, as last written. The mode and
+  // coincidence flag are worked out when STAT is read.
+  u8 stat = 0;
+  u8 lyc = 0;
+  bool coincidence = false;
+
   struct MODE
   {
     enum Mode
@@ -67,14 +124,26 @@ private:
   // Gameboy Colour palettes
   std::vector<u8> cgb_background_palettes = std::vector<u8>(0x40);
   std::vector<u8> cgb_sprite_palettes = std::vector<u8>(0x40);
-  int cgb_background_palette_index, cgb_sprite_palette_index;
-  bool cgb_background_palette_autoinc, cgb_sprite_palette_autoinc;
+
+  // The same palettes converted to display colours, updated as they're written
+  Colour cgb_background_colours[8][4] = {};
+  Colour cgb_sprite_colours[8][4] = {};
+  bool colour_correction = false;
+  int cgb_background_palette_index = 0, cgb_sprite_palette_index = 0;
+  bool cgb_background_palette_autoinc = false, cgb_sprite_palette_autoinc = false;
 
   void draw_scanline();
+  void decode_background_palette();
+  Colour decode_cgb_colour(const std::vector<u8> &palettes, uint index) const;
+  void decode_cgb_palettes();
   void draw_background();
   void clear_background();
   void draw_window();
+  void draw_tiles(uint tile_map_addr, uint tile_col, uint tile_y, int x);
   void draw_sprites();
+  void write_line(u8 LY);
 
-  void update_status();
+  MODE::Mode get_mode(u8 scanline) const;
+  void raise_mode_interrupt(MODE::Mode mode);
+  void check_coincidence();
 };
@@ -1,39 +1,175 @@
 #include "gameboy.h"
+#include "state.h"
+#include <stdio.h>
+
+const u32 Gameboy::state_magic;
+const u32 Gameboy::state_version;
 
 void Gameboy::load_rom(std::istream& rom, std::istream& ram)
 {
-  cart.init_cartridge(rom, ram);
+  load_rom(RomImage::read(rom), ram);
+}
+
+void Gameboy::load_rom(std::shared_ptr<const RomImage> rom, std::istream& ram)
+{
+  cart.init_cartridge(std::move(rom), ram);
+  memory.map_cartridge();
+  cpu.clear_blocks();
+
+  update_state_sizes();
+}
+
+void Gameboy::update_state_sizes()
+{
+  std::vector<u8> state;
+  save_state(state);
+  state_size = state.size();
+  save_state(state, false);
+  frameless_state_size = state.size();
 }
 
 void Gameboy::set_save_callback(MemoryBankController::SaveRAMCallback save_ram)
 {
-  cart.set_save_callback(save_ram);
+  cart.set_save_callback(std::move(save_ram));
+}
+
+void Gameboy::set_pixel_format(Display::PixelFormat format)
+{
+  display.set_pixel_format(format);
+
+  // Frames are part of save states
+  if (state_size)
+  {
+    update_state_sizes();
+  }
 }
 
-void Gameboy::run_to_vblank()
+bool Gameboy::map_save_file(const std::string &path)
 {
+  if (!cart.map_save_file(path))
+    return false;
+
+  // RAM has moved
+  memory.map_cartridge();
+  return true;
+}
+
+uint Gameboy::run_to_vblank()
+{
+  uint steps = 0;
   while (!display.in_vblank())
   {
-    step();
+    steps += step();
   }
   while (display.in_vblank())
   {
-    step();
+    steps += step();
   }
+  return steps;
 }
 
-void Gameboy::step()
+uint Gameboy::step()
 {
-  uint cycles = cpu.step();
-  display.update(cycles);
-  audio.update(cycles);
+  if (cpu.idle())
+  {
+    // Only a component can raise an interrupt, so skip straight to the next
+    // one that's due instead of waiting 4 cycles at a time
+    uint steps = (scheduler.cycles_until_event() + 3) / 4;
+    if (steps == 0)
+    {
+      steps = 1;
+    }
+    scheduler.step(steps * 4);
+    cpu.handle_interrupts();
+    return steps;
+  }
+
+  // Run a whole block of cached instructions if possible
+  uint steps = cpu.run_block(scheduler);
+  if (steps == 0)
+  {
+    uint cycles = cpu.step();
+    scheduler.step(cycles);
+    steps = 1;
+  }
   cpu.handle_interrupts();
+  return steps;
+}
+
+void Gameboy::save_state(std::vector<u8> &state, bool framebuffer) const
+{
+  state.clear();
+  state.reserve(framebuffer ? state_size : frameless_state_size);
+  StateWriter writer(state);
+
+  writer.write(state_magic);
+  writer.write(state_version);
+  writer.write(cart.get_checksum());
+  writer.write(static_cast<u8>(gb_version));
+
+  cpu.save_state(writer);
+  memory.save_state(writer);
+  cart.save_state(writer);
+  display.save_state(writer, framebuffer);
+  joypad.save_state(writer);
+  audio.save_state(writer);
+  timer.save_state(writer);
+  scheduler.save_state(writer);
+}
+
+bool Gameboy::load_state(const std::vector<u8> &state, bool framebuffer)
+{
+  StateReader reader(state);
+
+  u32 magic = 0, version = 0, checksum = 0;
+  reader.read(magic);
+  reader.read(version);
+  reader.read(checksum);
+  if (!reader.ok() || magic != state_magic || version != state_version ||
+      checksum != cart.get_checksum())
+  {
+    return false;
+  }
+
+  // Check the whole state is there before touching anything
+  if (state.size() != (framebuffer ? state_size : frameless_state_size))
+  {
+    return false;
+  }
+
+  u8 version_ = 0xff;
+  reader.read(version_);
+  if (version_ != static_cast<u8>(GB_VERSION::ORIGINAL) &&
+      version_ != static_cast<u8>(GB_VERSION::COLOUR))
+  {
+    return false;
+  }
+  set_version(static_cast<GB_VERSION>(version_));
+
+  cpu.load_state(reader);
+  memory.load_state(reader);
+  cart.load_state(reader);
+  display.load_state(reader, framebuffer);
+  joypad.load_state(reader);
+  audio.load_state(reader);
+  timer.load_state(reader);
+  scheduler.load_state(reader);
+
+  // The cartridge's banks weren't restored yet when memory was mapped
+  memory.map_cartridge();
+
+  return reader.ok();
 }
 
 void Gameboy::set_debug(DEBUG_MODE debug_mode, bool debug)
 {
   if (debug_mode == DEBUG_MODE::CPU || debug_mode == DEBUG_MODE::ALL)
   {
+    if (debug && !LR35902::can_trace())
+    {
+      fprintf(stderr, "Instruction trace needs GB_INTERPRETER=table, this is built with %s\n",
+              LR35902::interpreter());
+    }
     cpu.debug = debug;
   }
   if (debug_mode == DEBUG_MODE::AUDIO || debug_mode == DEBUG_MODE::ALL)
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <istream>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "lr35902.h"
 #include "memory.h"
@@ -8,16 +11,20 @@
 #include "display.h"
 #include "joypad.h"
 #include "audio.h"
+#include "timer.h"
+#include "scheduler.h"
 
 class Gameboy
 {
 public:
   Gameboy() : cpu(memory),
-              memory(cart, joypad, audio, display),
+              memory(cart, joypad, audio, display, timer, scheduler),
               cart(*this),
               display(cpu, memory),
               joypad(cpu, memory),
-              audio(memory) { }
+              audio(memory),
+              timer(cpu),
+              scheduler(display, timer, audio) { }
 
   enum class DEBUG_MODE
   {
@@ -33,18 +40,55 @@ public:
   };
 
   void load_rom(std::istream& rom, std::istream& ram);
+  // Runs a ROM which may be shared with other Gameboys, such as one mapped
+  // with RomImage::map()
+  void load_rom(std::shared_ptr<const RomImage> rom, std::istream& ram);
+  // Whether a ROM's cartridge hardware is supported. Loading one which isn't
+  // aborts, so check first where that matters.
+  static bool is_supported(const RomImage &rom) { return Cartridge::is_supported(rom); }
   void set_save_callback(MemoryBankController::SaveRAMCallback save_ram);
-  void run_to_vblank();
-  void step();
+  // Keeps cartridge RAM in a memory mapped save file instead, which is
+  // created if it doesn't exist and written out in the background. The save
+  // callback isn't used after this. Returns false if the file can't be
+  // mapped, leaving RAM as it was.
+  bool map_save_file(const std::string &path);
+  // Returns the number of steps taken: one per instruction executed, or per
+  // 4 cycles spent halted
+  uint run_to_vblank();
+  // Runs one instruction, or a block of them, and returns how many steps
+  uint step();
   void reset();
   void set_debug(DEBUG_MODE debug_mode, bool debug);
   void set_muted(bool muted);
+  bool is_muted() const { return audio.is_muted(); }
+  void set_audio_output(AudioOutput *output) { audio.set_output(output); }
   void set_version(GB_VERSION version);
-  const Display::Colour *get_framebuffer() const { return display.get_framebuffer(); }
+  void set_colour_correction(bool correct) { display.set_colour_correction(correct); }
+  // The last whole frame, in the pixel format chosen (RGB888 by default).
+  // Changing format discards save states taken in the old one.
+  void set_pixel_format(Display::PixelFormat format);
+  const u8 *get_framebuffer() const { return display.get_framebuffer(); }
+  uint get_framebuffer_pitch() const { return display.get_framebuffer_pitch(); }
+  size_t get_framebuffer_size() const { return display.get_framebuffer_size(); }
+  // Which lines of the framebuffer changed in the last frame, so unchanged
+  // frames or lines don't need to be uploaded, encoded or sent again
+  const Display::LineSet &get_changed_lines() const { return display.get_changed_lines(); }
+  // Total cycles emulated, and how many of those were skipped by fast
+  // forwarding through loops which only poll registers or memory
+  u64 get_cycles() const { return scheduler.get_cycles(); }
+  u64 get_idle_cycles() const { return cpu.get_idle_cycles(); }
   void button_pressed(Joypad::Button::Name b) { joypad.button_pressed(b); }
   void button_released(Joypad::Button::Name b) { joypad.button_released(b); }
   void save() { cart.save(); }
 
+  // Snapshot the whole emulator state between frames. States can only be
+  // restored into a Gameboy running the same ROM, by the same version of
+  // this emulator. load_state() returns false if the state can't be used.
+  // States without the framebuffer are much smaller, but loading one leaves
+  // the last frame drawn in place, and they can only be loaded as such.
+  void save_state(std::vector<u8> &state, bool framebuffer = true) const;
+  bool load_state(const std::vector<u8> &state, bool framebuffer = true);
+
   bool gb_version_set = false;
 
 private:
@@ -54,6 +98,17 @@ private:
   Display display;
   Joypad joypad;
   Audio audio;
+  Timer timer;
+  Scheduler scheduler;
 
   GB_VERSION gb_version;
+
+  static const u32 state_magic = 0x54534247; // "GBST"
+  static const u32 state_version = 6;
+
+  // Save states are always the same size once a ROM has been loaded, until
+  // the pixel format changes
+  size_t state_size = 0;
+  size_t frameless_state_size = 0;
+  void update_state_sizes();
 };
@@ -1,6 +1,7 @@
 #include "joypad.h"
 #include "memory.h"
 #include "lr35902.h"
+#include "state.h"
 #include <stdio.h>
 
 Joypad::Joypad(LR35902 &lr35902, Memory &mem) : cpu(lr35902), memory(mem)
@@ -21,6 +22,16 @@ void Joypad::button_released(Button::Name b)
   memory.direct_io_write8(Memory::IO::JOYP, get_button_state());
 }
 
+void Joypad::save_state(StateWriter &state) const
+{
+  state.write(buttons);
+}
+
+void Joypad::load_state(StateReader &state)
+{
+  state.read(buttons);
+}
+
 u8 Joypad::get_button_state() const
 {
   u8 JOYP = memory.get8(Memory::IO::JOYP);
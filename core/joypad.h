@@ -4,6 +4,8 @@
 
 class LR35902;
 class Memory;
+class StateWriter;
+class StateReader;
 
 class Joypad
 {
@@ -34,4 +36,7 @@ public:
   void button_pressed(Button::Name b);
   void button_released(Button::Name b);
   u8 get_button_state() const;
+
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
 };
@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <algorithm>
 
 #include "lr35902.h"
 #include "memory.h"
 #include "display.h"
+#include "scheduler.h"
+#include "state.h"
 
 LR35902::InstrFunc LR35902::optable[LR35902::table_size];
 LR35902::OpInfo LR35902::infotable[LR35902::table_size];
@@ -13,6 +16,8 @@ LR35902::OpInfo LR35902::infotable_cb[LR35902::table_size];
 constexpr LR35902::OpInfo LR35902::unknown_info;
 constexpr LR35902::Instruction LR35902::implemented_instruction_table[];
 constexpr LR35902::Instruction LR35902::implemented_instruction_table_cb[];
+const uint LR35902::max_block_ops;
+const uint LR35902::block_cache_size;
 
 uint LR35902::step()
 {
@@ -30,13 +35,405 @@ uint LR35902::step()
     execute();
     // curr_instr_cycles when halted?
     reg.f &= 0xf0;
-    timer.update(curr_instr_cycles);
 
     return curr_instr_cycles;
   }
   return 4; // 4 cycles when halted? - just made this up
 }
 
+namespace
+{
+  // Instructions which may jump, so end a block
+  bool is_branch(u8 opcode)
+  {
+    switch (opcode)
+    {
+      case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+      case 0xc2: case 0xc3: case 0xca: case 0xd2: case 0xda: case 0xe9: // JP
+      case 0xc4: case 0xcc: case 0xcd: case 0xd4: case 0xdc: // CALL
+      case 0xc0: case 0xc8: case 0xc9: case 0xd0: case 0xd8: case 0xd9: // RET
+      case 0xc7: case 0xcf: case 0xd7: case 0xdf: // RST
+      case 0xe7: case 0xef: case 0xf7: case 0xff:
+        return true;
+      default:
+        return false;
+    }
+  }
+}
+
+namespace
+{
+  // How an instruction uses A, for finding loops which only poll memory.
+  // INVALID instructions could have other effects.
+  enum class PollOp
+  {
+    INVALID,
+    NO_A,
+    LOAD_A,   // Loads A from memory
+    READ_A,   // Compares or tests A
+    MODIFY_A, // ANDs or ORs A with something which doesn't change
+  };
+
+  PollOp classify_poll_op(u16 index)
+  {
+    if (index & 0x100)
+    {
+      // BIT n, r
+      u8 opcode = index & 0xff;
+      if (opcode >= 0x40 && opcode < 0x80)
+      {
+        return (opcode & 0x7) == 0x7 ? PollOp::READ_A : PollOp::NO_A;
+      }
+      return PollOp::INVALID;
+    }
+
+    switch (index)
+    {
+      case 0x00: // NOP
+        return PollOp::NO_A;
+      case 0x0a: case 0x1a: case 0x7e: // LD A, (BC) / (DE) / (HL)
+      case 0xf0: case 0xf2: case 0xfa: // LDH A, (n) / LD A, (C) / LD A, (nn)
+        return PollOp::LOAD_A;
+      case 0xfe: // CP d8
+        return PollOp::READ_A;
+      case 0xe6: case 0xf6: // AND d8 / OR d8
+        return PollOp::MODIFY_A;
+      default:
+        break;
+    }
+    if (index >= 0xb8 && index <= 0xbf)
+    {
+      // CP r
+      return PollOp::READ_A;
+    }
+    if ((index >= 0xa0 && index <= 0xa7) || (index >= 0xb0 && index <= 0xb7))
+    {
+      // AND r / OR r
+      return PollOp::MODIFY_A;
+    }
+    return PollOp::INVALID;
+  }
+}
+
+uint LR35902::run_cached_block(Scheduler &scheduler)
+{
+  const u8 *code = memory.get_code(reg.pc);
+  if (!code)
+  {
+    return 0;
+  }
+
+  if (blocks.empty())
+  {
+    blocks.resize(block_cache_size);
+  }
+
+  // Blocks are looked up by the memory they came from, so switching ROM banks
+  // doesn't need to invalidate anything
+  Block &block = blocks[reg.pc & (block_cache_size - 1)];
+  if (block.code != code ||
+      (block.generation && *block.generation != block.expected_generation))
+  {
+    build_block(block, reg.pc, code);
+  }
+
+  // Interrupts can only become pending when a component is updated or a
+  // register is written, so they only need checking between blocks
+  uint address = reg.pc;
+  u32 writes = memory.get_side_effect_writes();
+  memory.reset_stable_reads();
+  uint cycles = 0;
+  for (uint i=0; i<block.count; i++)
+  {
+    const BlockOp &op = block.ops[i];
+    reg.pc += op.length;
+    curr_instr_cycles = op.cycles;
+
+    InstrFunc instr = (op.index & 0x100) ? optable_cb[op.index & 0xff] : optable[op.index];
+    (this->*instr)();
+    reg.f &= 0xf0;
+    cycles += curr_instr_cycles;
+
+    if (scheduler.step(curr_instr_cycles) || memory.get_side_effect_writes() != writes)
+    {
+      return i + 1;
+    }
+  }
+
+  if (block.idle_loop && reg.pc == address)
+  {
+    // Every iteration of the loop will do exactly the same until something
+    // is updated or a register it reads changes, so skip as many whole
+    // iterations as fit before then
+    uint limit = std::min(scheduler.cycles_until_event(), memory.get_stable_cycles());
+    uint iterations = limit > 0 ? (limit - 1) / cycles : 0;
+    scheduler.step(iterations * cycles);
+    idle_cycles += iterations * cycles;
+    return (iterations + 1) * block.count;
+  }
+  return block.count;
+}
+
+void LR35902::build_block(Block &block, uint address, const u8 *code)
+{
+  block.code = code;
+  block.generation = nullptr;
+  block.expected_generation = 0;
+  block.count = 0;
+
+  // Code in work RAM must be decoded again once it's written to
+  if (address >= 0x8000)
+  {
+    block.generation = memory.protect_code(address);
+    if (!block.generation)
+    {
+      // Leave the block empty so that step() is used instead
+      return;
+    }
+    block.expected_generation = *block.generation;
+  }
+
+  uint remaining = 0x100 - (address & 0xff);
+  uint offset = 0;
+  while (block.count < max_block_ops && offset < remaining)
+  {
+    u8 opcode = code[offset];
+    u16 index = opcode;
+    InstrFunc instr = optable[opcode];
+    OpInfo info = infotable[opcode];
+    if (opcode == 0xcb)
+    {
+      if (offset + 1 >= remaining)
+      {
+        break;
+      }
+      index = 0x100 | code[offset + 1];
+      instr = optable_cb[code[offset + 1]];
+      info = infotable_cb[code[offset + 1]];
+    }
+
+    // Instructions which change the CPU's state are left to step()
+    if (instr == &LR35902::unknown_instruction || opcode == 0x10 ||
+        opcode == 0x76 || opcode == 0xf3 || opcode == 0xfb)
+    {
+      break;
+    }
+
+    if (offset + info.length > remaining)
+    {
+      break;
+    }
+
+    block.ops[block.count++] = {index, static_cast<u8>(info.length), static_cast<u8>(info.cycles)};
+    offset += info.length;
+
+    if (index < 0x100 && is_branch(opcode))
+    {
+      break;
+    }
+  }
+
+  block.idle_loop = is_idle_loop(block, address);
+}
+
+bool LR35902::is_idle_loop(const Block &block, uint address)
+{
+  if (block.count == 0)
+  {
+    return false;
+  }
+
+  // The block must jump back to its own start
+  uint length = 0;
+  for (uint i=0; i<block.count; i++)
+  {
+    length += block.ops[i].length;
+  }
+
+  const u8 *end = block.code + length;
+  uint target;
+  switch (block.ops[block.count - 1].index)
+  {
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+      target = address + length + static_cast<s8>(end[-1]);
+      break;
+    case 0xc2: case 0xc3: case 0xca: case 0xd2: case 0xda: // JP
+      target = end[-2] | (end[-1] << 8);
+      break;
+    default:
+      return false;
+  }
+  if ((target & 0xffff) != address)
+  {
+    return false;
+  }
+
+  // Everything else may only read memory into A and test it. If A changes
+  // then it must be loaded before being used, so that each iteration does
+  // exactly the same as the last.
+  bool writes_a = false;
+  for (uint i=0; i<block.count - 1; i++)
+  {
+    PollOp op = classify_poll_op(block.ops[i].index);
+    if (op == PollOp::INVALID)
+    {
+      return false;
+    }
+    writes_a |= (op == PollOp::LOAD_A || op == PollOp::MODIFY_A);
+  }
+
+  bool loaded = false;
+  for (uint i=0; i<block.count - 1; i++)
+  {
+    PollOp op = classify_poll_op(block.ops[i].index);
+    if (op == PollOp::LOAD_A)
+    {
+      loaded = true;
+    }
+    else if (op != PollOp::NO_A && writes_a && !loaded)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LR35902::clear_blocks()
+{
+  blocks.clear();
+}
+
+#if defined(GB_INTERPRETER_SWITCH) || defined(GB_INTERPRETER_GOTO)
+
+template <uint N>
+constexpr LR35902::Instruction LR35902::find_instruction(const Instruction (&table)[N], u8 opcode)
+{
+  for (const Instruction &instr : table)
+  {
+    if (instr.opcode == opcode)
+      return instr;
+  }
+  return {opcode, &LR35902::unknown_instruction, unknown_info};
+}
+
+template <bool prefix_cb, u8 opcode>
+inline void LR35902::execute_opcode()
+{
+  constexpr Instruction instr = prefix_cb ?
+    find_instruction(implemented_instruction_table_cb, opcode) :
+    find_instruction(implemented_instruction_table, opcode);
+
+  reg.pc += instr.opinfo.length;
+  curr_instr_cycles = instr.opinfo.cycles;
+  (this->*instr.func)();
+}
+
+// Expands X(0x00) X(0x01) ... X(0xff)
+#define FOR_EACH_OPCODE_16(X, high) \
+  X(high##0) X(high##1) X(high##2) X(high##3) X(high##4) X(high##5) X(high##6) X(high##7) \
+  X(high##8) X(high##9) X(high##a) X(high##b) X(high##c) X(high##d) X(high##e) X(high##f)
+#define FOR_EACH_OPCODE(X) \
+  FOR_EACH_OPCODE_16(X, 0x0) FOR_EACH_OPCODE_16(X, 0x1) FOR_EACH_OPCODE_16(X, 0x2) \
+  FOR_EACH_OPCODE_16(X, 0x3) FOR_EACH_OPCODE_16(X, 0x4) FOR_EACH_OPCODE_16(X, 0x5) \
+  FOR_EACH_OPCODE_16(X, 0x6) FOR_EACH_OPCODE_16(X, 0x7) FOR_EACH_OPCODE_16(X, 0x8) \
+  FOR_EACH_OPCODE_16(X, 0x9) FOR_EACH_OPCODE_16(X, 0xa) FOR_EACH_OPCODE_16(X, 0xb) \
+  FOR_EACH_OPCODE_16(X, 0xc) FOR_EACH_OPCODE_16(X, 0xd) FOR_EACH_OPCODE_16(X, 0xe) \
+  FOR_EACH_OPCODE_16(X, 0xf)
+
+#endif
+
+#if defined(GB_INTERPRETER_SWITCH)
+
+const char *LR35902::interpreter()
+{
+  return "switch";
+}
+
+// Debug tracing isn't available in this interpreter
+bool LR35902::can_trace()
+{
+  return false;
+}
+
+void LR35902::execute()
+{
+  u8 opcode = memory.get8(reg.pc);
+  switch (opcode)
+  {
+#define OPCODE_CASE(n) case n: execute_opcode<false, n>(); break;
+    FOR_EACH_OPCODE(OPCODE_CASE)
+#undef OPCODE_CASE
+    default:
+      abort();
+  }
+}
+
+void LR35902::execute_cb()
+{
+  u8 opcode = memory.get8(reg.pc + 1);
+  switch (opcode)
+  {
+#define OPCODE_CASE(n) case n: execute_opcode<true, n>(); break;
+    FOR_EACH_OPCODE(OPCODE_CASE)
+#undef OPCODE_CASE
+    default:
+      abort();
+  }
+}
+
+#elif defined(GB_INTERPRETER_GOTO)
+
+const char *LR35902::interpreter()
+{
+  return "goto";
+}
+
+// Debug tracing isn't available in this interpreter
+bool LR35902::can_trace()
+{
+  return false;
+}
+
+// Uses the labels as values extension supported by GCC and Clang
+
+void LR35902::execute()
+{
+#define OPCODE_LABEL(n) &&opcode_##n,
+  static const void *const labels[table_size] = { FOR_EACH_OPCODE(OPCODE_LABEL) };
+#undef OPCODE_LABEL
+
+  goto *labels[memory.get8(reg.pc)];
+
+#define OPCODE_TARGET(n) opcode_##n: execute_opcode<false, n>(); return;
+  FOR_EACH_OPCODE(OPCODE_TARGET)
+#undef OPCODE_TARGET
+}
+
+void LR35902::execute_cb()
+{
+#define OPCODE_LABEL(n) &&opcode_##n,
+  static const void *const labels[table_size] = { FOR_EACH_OPCODE(OPCODE_LABEL) };
+#undef OPCODE_LABEL
+
+  goto *labels[memory.get8(reg.pc + 1)];
+
+#define OPCODE_TARGET(n) opcode_##n: execute_opcode<true, n>(); return;
+  FOR_EACH_OPCODE(OPCODE_TARGET)
+#undef OPCODE_TARGET
+}
+
+#else
+
+const char *LR35902::interpreter()
+{
+  return "table";
+}
+
+bool LR35902::can_trace()
+{
+  return true;
+}
+
 void LR35902::execute()
 {
   u8 opcode = memory.get8(reg.pc);
@@ -69,39 +466,43 @@ void LR35902::execute_cb()
   (this->*instr)();
 }
 
+#endif
+
 void LR35902::handle_interrupts()
 {
   if (interrupt_master_enable)
   {
-    if (get_interrupt_enable(0) && get_interrupt_flag(0))
+    u8 pending = memory.get8(Memory::IO::IE) & memory.get8(Memory::IO::IF);
+
+    if (pending & (1<<0))
     {
       // V-Blank
       halted = false;
       clear_interrupt_flag(0);
       call_interrupt_handler(0x40);
     }
-    else if (get_interrupt_enable(1) && get_interrupt_flag(1))
+    else if (pending & (1<<1))
     {
       // LCD STAT
       halted = false;
       clear_interrupt_flag(1);
       call_interrupt_handler(0x48);
     }
-    else if (get_interrupt_enable(2) && get_interrupt_flag(2))
+    else if (pending & (1<<2))
     {
       // Timer
       halted = false;
       clear_interrupt_flag(2);
       call_interrupt_handler(0x50);
     }
-    else if (get_interrupt_enable(3) && get_interrupt_flag(3))
+    else if (pending & (1<<3))
     {
       // Serial
       halted = false;
       clear_interrupt_flag(3);
       call_interrupt_handler(0x58);
     }
-    else if (get_interrupt_enable(4) && get_interrupt_flag(4))
+    else if (pending & (1<<4))
     {
       // Joypad
       halted = false;
@@ -124,31 +525,46 @@ void LR35902::raise_interrupt(Interrupt::Type interrupt)
 {
   u8 IF = memory.get8(Memory::IO::IF);
   IF |= 1 << interrupt;
-  memory.set8(Memory::IO::IF, IF);
+  memory.direct_io_write8(Memory::IO::IF, IF);
 }
 
-bool LR35902::get_interrupt_enable(uint bit) const
+void LR35902::clear_interrupt_flag(uint bit)
 {
-  return memory.get8(Memory::IO::IE) & (1 << bit);
+  u8 IF = memory.get8(Memory::IO::IF);
+  memory.direct_io_write8(Memory::IO::IF, IF & ~(1<<bit));
 }
 
-bool LR35902::get_interrupt_flag(uint bit) const
+void LR35902::save_state(StateWriter &state) const
 {
-  return memory.get8(Memory::IO::IF) & (1 << bit);
+  state.write(reg);
+  state.write(interrupt_master_enable);
+  state.write(ime_pending);
+  state.write(ime_delay);
+  state.write(halted);
+  state.write(stopped);
 }
 
-void LR35902::clear_interrupt_flag(uint bit)
+void LR35902::load_state(StateReader &state)
 {
-  u8 IF = memory.get8(Memory::IO::IF);
-  memory.set8(Memory::IO::IF, IF & ~(1<<bit));
+  state.read(reg);
+  state.read(interrupt_master_enable);
+  state.read(ime_pending);
+  state.read(ime_delay);
+  state.read(halted);
+  state.read(stopped);
 }
 
 void LR35902::init_tables()
 {
-  static bool initialised = false;
-  if (initialised)
-    return;
+  // The tables are shared by all instances, which may be created on several
+  // threads at once. Initialisation of a local static is thread-safe and only
+  // happens once.
+  static const bool initialised = build_tables();
+  (void)initialised;
+}
 
+bool LR35902::build_tables()
+{
   for (int i=0; i<table_size; i++)
   {
     optable[i] = &LR35902::unknown_instruction;
@@ -173,6 +589,8 @@ void LR35902::init_tables()
     optable_cb[instr.opcode] = instr.func;
     infotable_cb[instr.opcode] = instr.opinfo;
   }
+
+  return true;
 }
 
 void LR35902::unknown_instruction()
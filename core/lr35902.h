@@ -1,9 +1,12 @@
 #pragma once
 
+#include <vector>
 #include "types.h"
-#include "timer.h"
 
 class Memory;
+class Scheduler;
+class StateWriter;
+class StateReader;
 
 class LR35902
 {
@@ -57,14 +60,11 @@ class LR35902
   uint get_flag_c() const { return (reg.f >> 4)&1; }
 
   bool interrupt_master_enable = true;
-  bool ime_pending;
-  uint ime_delay;
-  bool get_interrupt_enable(uint bit) const;
-  bool get_interrupt_flag(uint bit) const;
+  bool ime_pending = false;
+  uint ime_delay = 0;
   void clear_interrupt_flag(uint bit);
 
   Memory &memory;
-  Timer timer;
 
   uint curr_instr_cycles;
 
@@ -906,11 +906,53 @@ class LR35902
   static InstrFunc optable_cb[table_size];
   static OpInfo infotable_cb[table_size];
 
-  void init_tables();
+  static void init_tables();
+  static bool build_tables();
+
+  // Compile time lookup into the instruction tables, for the switch and
+  // computed goto interpreters. Each opcode gets its own copy of
+  // execute_opcode() with the instruction's implementation inlined.
+  template <uint N>
+  static constexpr Instruction find_instruction(const Instruction (&table)[N], u8 opcode);
+  template <bool prefix_cb, u8 opcode> void execute_opcode();
+
+  // Basic block cache. Runs of straight-line code are decoded once, then
+  // executed without fetching and looking up each opcode again. Blocks end
+  // with the first jump, call or return, and never cross a 256 byte page.
+  struct BlockOp
+  {
+    u16 index;  // Opcode, plus 0x100 for instructions prefixed by 0xcb
+    u8 length;
+    u8 cycles;
+  };
+
+  static const uint max_block_ops = 16;
+  static const uint block_cache_size = 0x1000;
+
+  struct Block
+  {
+    // Host memory the block was decoded from, which identifies the bank too
+    const u8 *code = nullptr;
+    // Generation of the work RAM page holding the block, nullptr for ROM
+    const u32 *generation = nullptr;
+    u32 expected_generation = 0;
+    uint count = 0;
+    // The block loops back to itself, doing nothing but polling memory
+    bool idle_loop = false;
+    BlockOp ops[max_block_ops];
+  };
+
+  std::vector<Block> blocks;
+  uint run_cached_block(Scheduler &scheduler);
+  void build_block(Block &block, uint address, const u8 *code);
+  static bool is_idle_loop(const Block &block, uint address);
+
+  // Cycles skipped by running idle loops many iterations at a time
+  u64 idle_cycles = 0;
 
 public:
   LR35902() = delete;
-  explicit LR35902(Memory &mem) : memory(mem), timer(*this, mem)
+  explicit LR35902(Memory &mem) : memory(mem)
   {
     init_tables();
     reg.pc = 0x100;
@@ -919,6 +961,33 @@ public:
 
   uint step();
 
+  // Run a cached block of instructions starting at pc, updating the scheduler
+  // after each one. Stops early when an event or a write with side effects
+  // might need an interrupt handled. Returns the number of instructions
+  // executed, or 0 if the code can't be cached and step() must be used.
+  uint run_block(Scheduler &scheduler)
+  {
+    // Anything out of the ordinary is left to step()
+    if (halted || stopped || ime_delay > 0 || debug)
+    {
+      return 0;
+    }
+    return run_cached_block(scheduler);
+  }
+
+  // Halted or stopped, so nothing happens until an interrupt is raised
+  bool idle() const { return (halted || stopped) && ime_delay == 0; }
+
+  u64 get_idle_cycles() const { return idle_cycles; }
+
+  // Forget all cached blocks, e.g. when a different ROM is loaded
+  void clear_blocks();
+
+  // Which interpreter this was built with (see GB_INTERPRETER)
+  static const char *interpreter();
+  // Whether the debug instruction trace is built in, which it only is in table
+  static bool can_trace();
+
   bool debug = false;
   bool halted = false;
   bool stopped = false;
@@ -937,4 +1006,7 @@ public:
 
   void raise_interrupt(Interrupt::Type interrupt);
   void handle_interrupts();
+
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
 };
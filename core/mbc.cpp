@@ -1,4 +1,5 @@
 #include "mbc.h"
+#include "state.h"
 
 MemoryBankController::~MemoryBankController()
 {
@@ -10,7 +11,48 @@ MemoryBankController::~MemoryBankController()
 
 void MemoryBankController::save()
 {
-  (*save_ram_callback)(ram.data(), ram.size());
+  // Nothing to do if the frontend doesn't want to keep save games
+  if (!save_ram_callback)
+    return;
+
+  save_ram_callback(ram, ram_size);
+}
+
+const u8 *MemoryBankController::rom_bank() const
+{
+  uint offset = active_rom_bank*0x4000;
+  if (offset + 0x4000 > rom_size)
+  {
+    // Let get8 deal with out of range banks
+    return nullptr;
+  }
+  return rom + offset;
+}
+
+u8 *MemoryBankController::ram_bank()
+{
+  uint offset = active_ram_bank*0x2000;
+  if (!ram_enabled || offset + 0x2000 > ram_size)
+  {
+    return nullptr;
+  }
+  return ram + offset;
+}
+
+void MemoryBankController::save_state(StateWriter &state) const
+{
+  state.write_buffer(ram, ram_size);
+  state.write(active_rom_bank);
+  state.write(active_ram_bank);
+  state.write(ram_enabled);
+}
+
+void MemoryBankController::load_state(StateReader &state)
+{
+  state.read_buffer(ram, ram_size);
+  state.read(active_rom_bank);
+  state.read(active_ram_bank);
+  state.read(ram_enabled);
 }
 
 u8 NoMBC::get8(uint address) const
@@ -18,25 +60,27 @@ u8 NoMBC::get8(uint address) const
   if (address < 0x8000)
   {
     // ROM
-    return rom.at(address);
+    return rom_byte(address);
   }
   else if (address >= 0xa000 && address < 0xc000)
   {
     // RAM
-    return ram.at(address - 0xa000);
+    return ram_byte(address - 0xa000);
   }
 
   // Should never get here
   return 0;
 }
 
-void NoMBC::set8(uint address, u8 value)
+uint NoMBC::set8(uint address, u8 value)
 {
   if (address >= 0xa000 && address < 0xc000)
   {
     // RAM
-    ram.at(address - 0xa000) = value;
+    return set_ram_byte(address - 0xa000, value);
   }
+
+  return no_ram_write;
 }
 
 u8 MBC1::get8(uint address) const
@@ -44,18 +88,18 @@ u8 MBC1::get8(uint address) const
   if (address < 0x4000)
   {
     // ROM bank 0
-    return rom.at(address);
+    return rom_byte(address);
   }
   else if (address >= 0x4000 && address < 0x8000)
   {
     // Switchable ROM bank (1 - 127)
-    return rom.at(active_rom_bank*0x4000 + address - 0x4000);
+    return rom_byte(active_rom_bank*0x4000 + address - 0x4000);
   }
   else if (address >= 0xa000 && address < 0xc000)
   {
     // Switchable RAM bank (0 - 3)
     if (ram_enabled)
-      return ram.at(active_ram_bank*0x2000 + address - 0xa000);
+      return ram_byte(active_ram_bank*0x2000 + address - 0xa000);
     else
       return 0;
   }
@@ -64,7 +108,7 @@ u8 MBC1::get8(uint address) const
   return 0;
 }
 
-void MBC1::set8(uint address, u8 value)
+uint MBC1::set8(uint address, u8 value)
 {
   if (address < 0x2000)
   {
@@ -111,9 +155,23 @@ void MBC1::set8(uint address, u8 value)
     // Switchable RAM bank (0 - 3)
     if (ram_enabled)
     {
-      ram.at(active_ram_bank*0x2000 + address - 0xa000) = value;
+      return set_ram_byte(active_ram_bank*0x2000 + address - 0xa000, value);
     }
   }
+
+  return no_ram_write;
+}
+
+void MBC1::save_state(StateWriter &state) const
+{
+  MemoryBankController::save_state(state);
+  state.write(banking_mode);
+}
+
+void MBC1::load_state(StateReader &state)
+{
+  MemoryBankController::load_state(state);
+  state.read(banking_mode);
 }
 
 u8 MBC3::get8(uint address) const
@@ -121,12 +179,12 @@ u8 MBC3::get8(uint address) const
   if (address < 0x4000)
   {
     // ROM bank 0
-    return rom.at(address);
+    return rom_byte(address);
   }
   else if (address >= 0x4000 && address < 0x8000)
   {
     // Switchable ROM bank (1 - 127)
-    return rom.at(active_rom_bank*0x4000 + address - 0x4000);
+    return rom_byte(active_rom_bank*0x4000 + address - 0x4000);
   }
   else if (address >= 0xa000 && address < 0xc000)
   {
@@ -135,7 +193,7 @@ u8 MBC3::get8(uint address) const
       if (banking_mode == BankingMode::RAM)
       {
         // Switchable RAM bank (0 - 3)
-        return ram.at(active_ram_bank*0x2000 + address - 0xa000);
+        return ram_byte(active_ram_bank*0x2000 + address - 0xa000);
       }
       else
       {
@@ -153,7 +211,34 @@ u8 MBC3::get8(uint address) const
   return 0;
 }
 
-void MBC3::set8(uint address, u8 value)
+u8 *MBC3::ram_bank()
+{
+  if (banking_mode == BankingMode::RTC)
+  {
+    // RTC registers are mapped in instead of RAM
+    return nullptr;
+  }
+  return MemoryBankController::ram_bank();
+}
+
+void MBC3::save_state(StateWriter &state) const
+{
+  MemoryBankController::save_state(state);
+  state.write(banking_mode);
+  state.write(active_rtc);
+  state.write(rtc);
+}
+
+void MBC3::load_state(StateReader &state)
+{
+  MemoryBankController::load_state(state);
+  state.read(banking_mode);
+  state.read(active_rtc);
+  state.read(rtc);
+  active_rtc %= 5;
+}
+
+uint MBC3::set8(uint address, u8 value)
 {
   if (address < 0x2000)
   {
@@ -199,7 +284,7 @@ void MBC3::set8(uint address, u8 value)
       if (banking_mode == BankingMode::RAM)
       {
         // Switchable RAM bank (0 - 3)
-        ram.at(active_ram_bank*0x2000 + address - 0xa000) = value;
+        return set_ram_byte(active_ram_bank*0x2000 + address - 0xa000, value);
       }
       else
       {
@@ -208,4 +293,6 @@ void MBC3::set8(uint address, u8 value)
       }
     }
   }
+
+  return no_ram_write;
 }
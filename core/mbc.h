@@ -1,29 +1,75 @@
 #pragma once
 
+#include <functional>
 #include <vector>
 #include "types.h"
 
+class StateWriter;
+class StateReader;
+
 class MemoryBankController
 {
 public:
   MemoryBankController() = delete;
-  MemoryBankController(const std::vector<u8> &rom, std::vector<u8> &ram) : rom(rom), ram(ram) {}
+  // ROM and RAM are used in place, and must outlive the controller
+  MemoryBankController(const u8 *rom, uint rom_size, u8 *ram, uint ram_size)
+    : rom(rom), rom_size(rom_size), ram(ram), ram_size(ram_size) {}
   virtual ~MemoryBankController();
 
-  virtual u8 get8(uint address) const = 0;
-  virtual void set8(uint address, u8 value) = 0;
+  // Each MBC also has get8(address) and set8(address, value). They aren't
+  // virtual: Cartridge calls them on the MBC's own type, and MBCs replace
+  // any of the functions below which work differently for them. set8
+  // returns the offset of the RAM byte it stored, or no_ram_write.
+  static const uint no_ram_write = ~0u;
+
+  // Memory currently mapped to the switchable ROM bank (0x4000 - 0x7fff)
+  // and RAM bank (0xa000 - 0xbfff), for direct access without get8/set8.
+  // nullptr is returned when accesses need to go through get8/set8.
+  const u8 *rom_bank() const;
+  u8 *ram_bank();
+
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
 
-  using SaveRAMCallback = void(*)(void *ram, uint size);
-  SaveRAMCallback save_ram_callback = nullptr;
+  // Called with the cartridge RAM when the game saves. Anything the frontend
+  // needs to find where to write it (e.g. a file name) can be captured here.
+  using SaveRAMCallback = std::function<void(void *ram, uint size)>;
+  SaveRAMCallback save_ram_callback;
 
   void save();
 
+  // Moves cartridge RAM somewhere else holding the same contents, such as a
+  // memory mapped save file
+  void move_ram(u8 *new_ram) { ram = new_ram; }
+
 protected:
-  const std::vector<u8> &rom;
-  std::vector<u8> &ram;
+  const u8 *rom;
+  uint rom_size;
+  u8 *ram;
+  uint ram_size;
   uint active_rom_bank = 1;
   uint active_ram_bank = 0;
   bool ram_enabled = false;
+
+  // Reads from banks beyond the end of the ROM see an open bus
+  u8 rom_byte(uint offset) const
+  {
+    return offset < rom_size ? rom[offset] : 0xff;
+  }
+
+  // Likewise for RAM banks, where writes are dropped
+  u8 ram_byte(uint offset) const
+  {
+    return offset < ram_size ? ram[offset] : 0xff;
+  }
+
+  uint set_ram_byte(uint offset, u8 value)
+  {
+    if (offset >= ram_size)
+      return no_ram_write;
+    ram[offset] = value;
+    return offset;
+  }
 };
 
 class NoMBC final : public MemoryBankController
@@ -31,8 +77,8 @@ class NoMBC final : public MemoryBankController
 public:
   using MemoryBankController::MemoryBankController;
 
-  u8 get8(uint address) const override;
-  void set8(uint address, u8 value) override;
+  u8 get8(uint address) const;
+  uint set8(uint address, u8 value);
 };
 
 class MBC1 final : public MemoryBankController
@@ -48,8 +94,10 @@ class MBC1 final : public MemoryBankController
 public:
   using MemoryBankController::MemoryBankController;
 
-  u8 get8(uint address) const override;
-  void set8(uint address, u8 value) override;
+  u8 get8(uint address) const;
+  uint set8(uint address, u8 value);
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
 };
 
 class MBC3 final : public MemoryBankController
@@ -76,13 +124,16 @@ class MBC3 final : public MemoryBankController
 
   BankingMode banking_mode = BankingMode::RAM;
 
-  uint active_rtc;
-  u8 rtc[5];
+  uint active_rtc = 0;
+  u8 rtc[5] = {};
   // TODO actually implement a clock
 
 public:
   using MemoryBankController::MemoryBankController;
 
-  u8 get8(uint address) const override;
-  void set8(uint address, u8 value) override;
+  u8 get8(uint address) const;
+  uint set8(uint address, u8 value);
+  u8 *ram_bank();
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
 };
@@ -1,49 +1,163 @@
+#include <string.h>
+
 #include "memory.h"
 #include "cartridge.h"
 #include "joypad.h"
 #include "audio.h"
 #include "display.h"
+#include "timer.h"
+#include "scheduler.h"
+#include "state.h"
 
-Memory::Memory(Cartridge &cartridge, Joypad &j, Audio &a, Display &d)
+Memory::Memory(Cartridge &cartridge, Joypad &j, Audio &a, Display &d, Timer &t, Scheduler &s)
   : cart(cartridge),
     joypad(j),
     audio(a),
-    display(d)
+    display(d),
+    timer(t),
+    scheduler(s)
 {
-  set8(IO::LCDC, 0xff); // LCD needs to be enabled at boot
+  map_vram();
+  map_wram();
+
+  direct_io_write8(IO::LCDC, 0xff); // LCD needs to be enabled at boot
 }
 
-u8 Memory::read_byte(uint address) const
+void Memory::save_state(StateWriter &state) const
 {
-  if (address < 0x8000 || (address >= 0xa000 && address < 0xc000))
+  state.write(vram);
+  state.write(wram);
+  state.write(hram);
+  state.write(oam);
+  state.write(io);
+  state.write(interrupt_enable);
+  state.write(active_vram_bank);
+  state.write(active_wram_bank);
+  state.write(hdma_source);
+  state.write(hdma_dest);
+  state.write(hdma_blocks);
+}
+
+void Memory::load_state(StateReader &state)
+{
+  state.read(vram);
+  state.read(wram);
+  state.read(hram);
+  state.read(oam);
+  state.read(io);
+  state.read(interrupt_enable);
+  state.read(active_vram_bank);
+  state.read(active_wram_bank);
+  state.read(hdma_source);
+  state.read(hdma_dest);
+  state.read(hdma_blocks);
+
+  active_vram_bank &= 0x1;
+  active_wram_bank &= 0x7;
+  hdma_source &= 0xfff0;
+  hdma_dest &= 0x1ff0;
+  hdma_blocks &= 0xff;
+
+  // Any code cached from work RAM is out of date
+  for (uint page=0; page<wram_pages; page++)
   {
-    // ROM / external RAM
-    return cart.get8(address);
+    if (wram_code[page])
+    {
+      wram_code[page] = false;
+      wram_generation[page]++;
+    }
   }
-  else if (address >= 0x8000 && address < 0xa000)
+
+  map_vram();
+  map_wram();
+  map_cartridge();
+}
+
+void Memory::map_pages(uint address, uint size, const u8 *read, u8 *write)
+{
+  for (uint offset=0; offset<size; offset+=page_size)
   {
-    // VRAM - Video RAM
-    return vram.at(active_vram_bank*0x2000 + address - 0x8000);
+    uint page = (address + offset) / page_size;
+    read_pages[page]  = read  ? read + offset  : nullptr;
+    write_pages[page] = write ? write + offset : nullptr;
   }
-  else if (address >= 0xc000 && address < 0xd000)
+}
+
+void Memory::map_vram()
+{
+  // VRAM - Video RAM
+  u8 *bank = &vram[active_vram_bank*0x2000];
+  map_pages(0x8000, 0x2000, bank, bank);
+}
+
+void Memory::map_wram()
+{
+  // WRAM - Work RAM bank 0
+  map_pages(0xc000, 0x1000, &wram[0], &wram[0]);
+
+  // Switchable Work RAM bank (1 - 7)
+  u8 *bank = &wram[active_wram_bank*0x1000];
+  map_pages(0xd000, 0x1000, bank, bank);
+
+  // ECHO - Mirror of C000 - DDFF
+  map_pages(0xe000, 0x1000, &wram[0], &wram[0]);
+  map_pages(0xf000, 0x0e00, bank, bank);
+
+  // Writes to pages holding cached code must invalidate it
+  for (uint page=0xc0; page<0xfe; page++)
   {
-    // WRAM - Work RAM bank 0
-    return wram.at(address - 0xc000);
+    if (wram_code[wram_page(page * page_size)])
+    {
+      write_pages[page] = nullptr;
+    }
   }
-  else if (address >= 0xd000 && address < 0xe000)
+}
+
+uint Memory::wram_page(uint address) const
+{
+  return (read_pages[address >> 8] - &wram[0]) / page_size;
+}
+
+const u32 *Memory::protect_code(uint address)
+{
+  uint page = wram_page(address);
+  if (wram_invalidations[page] >= max_code_invalidations)
   {
-    // Switchable Work RAM bank (1 - 7)
-    return wram.at(active_wram_bank*0x1000 + address - 0xd000);
+    return nullptr;
   }
-  else if (address >= 0xe000 && address < 0xfe00)
+
+  if (!wram_code[page])
   {
-    // ECHO - Mirror of C000 - DDFF
-    return wram.at(address - 0xe000);
+    wram_code[page] = true;
+    map_wram();
+  }
+  return &wram_generation[page];
+}
+
+void Memory::map_cartridge()
+{
+  // ROM is read only - writes go to the MBC registers
+  map_pages(0x0000, 0x4000, cart.rom_bank0(), nullptr);
+  map_pages(0x4000, 0x4000, cart.rom_bank(), nullptr);
+
+  // External RAM, if it's enabled and not mapped to anything more exotic
+  u8 *ram = cart.ram_bank();
+  map_pages(0xa000, 0x2000, ram, ram);
+}
+
+u8 Memory::read_byte(uint address) const
+{
+  // Only regions which aren't in the page tables need to be handled here
+
+  if (address < 0x8000 || (address >= 0xa000 && address < 0xc000))
+  {
+    // ROM / external RAM which can't be accessed directly
+    return cart.get8(address);
   }
   else if (address >= 0xfe00 && address < 0xfea0)
   {
     // Sprite attribute table
-    return oam.at(address - 0xfe00);
+    return oam[address - 0xfe00];
   }
   else if (address >= 0xfea0 && address < 0xff00)
   {
@@ -57,8 +171,22 @@ u8 Memory::read_byte(uint address) const
     {
       return audio.read_byte(address);
     }
+    else if (address >= IO::DIV && address <= IO::TAC)
+    {
+      // The timer only counts when asked to
+      scheduler.sync();
+      stable_for(timer.cycles_until_change(address));
+      return timer.read_byte(address);
+    }
+    else if (address == IO::STAT || address == IO::LYC)
+    {
+      // The display's mode is worked out from how far through the line it is
+      scheduler.sync();
+      stable_for(display.cycles_until_change(address));
+      return display.read_byte(address);
+    }
 
-    return io.at(address - 0xff00);
+    return io[address - 0xff00];
   }
   else if (address >= 0xff80 && address < 0xffff)
   {
@@ -67,7 +195,7 @@ u8 Memory::read_byte(uint address) const
     {
       return (gb_version == GB_VERSION::ORIGINAL) ? 0 : 1;
     }
-    return hram.at(address - 0xff80);
+    return hram[address - 0xff80];
   }
   else if (address == 0xffff)
   {
@@ -83,7 +211,7 @@ u8 Memory::read_byte(uint address, uint vram_bank) const
 {
   if (address >= 0x8000 && address < 0xa000)
   {
-    return vram.at(vram_bank*0x2000 + address - 0x8000);
+    return vram[vram_bank*0x2000 + address - 0x8000];
   }
 
   // Should only call this function when trying to access VRAM
@@ -92,35 +220,35 @@ u8 Memory::read_byte(uint address, uint vram_bank) const
 
 void Memory::write_byte(uint address, u8 value)
 {
-  if (address < 0x8000 || (address >= 0xa000 && address < 0xc000))
+  // Only regions which aren't in the page tables need to be handled here
+
+  if (address < 0x8000)
   {
-    // ROM / external RAM
+    // MBC registers - may switch the banks mapped in
     cart.set8(address, value);
+    map_cartridge();
+    side_effect_writes++;
   }
-  else if (address >= 0x8000 && address < 0xa000)
+  else if (address >= 0xa000 && address < 0xc000)
   {
-    // VRAM - Video RAM
-    vram.at(address - 0x8000) = value;
-  }
-  else if (address >= 0xc000 && address < 0xd000)
-  {
-    // WRAM - Work RAM bank 0
-    wram.at(address - 0xc000) = value;
-  }
-  else if (address >= 0xd000 && address < 0xe000)
-  {
-    // Switchable Work RAM bank (1 - 7)
-    wram.at(active_wram_bank*0x1000 + address - 0xd000) = value;
+    // External RAM which can't be accessed directly
+    cart.set8(address, value);
   }
-  else if (address >= 0xe000 && address < 0xfe00)
+  else if (address >= 0xc000 && address < 0xfe00)
   {
-    // ECHO - Mirror of C000 - DDFF
-    wram.at(address - 0xe000) = value;
+    // Work RAM holding cached code, which is now out of date
+    uint page = wram_page(address);
+    wram_code[page] = false;
+    wram_generation[page]++;
+    wram_invalidations[page]++;
+    side_effect_writes++;
+    map_wram();
+    write_pages[address >> 8][address & 0xff] = value;
   }
   else if (address >= 0xfe00 && address < 0xfea0)
   {
     // Sprite attribute table
-    oam.at(address - 0xfe00) = value;
+    oam[address - 0xfe00] = value;
   }
   else if (address >= 0xfea0 && address < 0xff00)
   {
@@ -130,10 +258,17 @@ void Memory::write_byte(uint address, u8 value)
   else if (address >= 0xff00 && address < 0xff80)
   {
     // IO registers
-    if (address == IO::DIV || address == IO::LY)
+    // Components must be up to date before anything they depend on changes
+    scheduler.sync();
+
+    if (address == IO::LY)
     {
       value = 0;
     }
+    else if (address >= IO::DIV && address <= IO::TAC)
+    {
+      timer.write_byte(address, value);
+    }
     else if (address == IO::DMA)
     {
       dma_transfer(value);
@@ -141,7 +276,7 @@ void Memory::write_byte(uint address, u8 value)
     else if (address == IO::JOYP)
     {
       // First set the control bits, then update the joypad state
-      io.at(IO::JOYP - 0xff00) = value;
+      io[IO::JOYP - 0xff00] = value;
       value = joypad.get_button_state();
     }
     else if (address >= IO::NR10 && address <= IO::WAVE + 0xf)
@@ -151,32 +286,39 @@ void Memory::write_byte(uint address, u8 value)
     else if (address == IO::VBK)
     {
       active_vram_bank = value & 0x1;
+      map_vram();
     }
     else if (address == IO::SVBK)
     {
       active_wram_bank = value & 0x7;
+      map_wram();
     }
-    else if (address == IO::BGPD || address == IO::OBPD ||
+    else if (address == IO::STAT || address == IO::LYC ||
+             address == IO::BGPD || address == IO::OBPD ||
              address == IO::BGPI || address == IO::OBPI)
     {
       display.write_byte(address, value);
     }
     else if (address == IO::HDMA5)
     {
-      hdma_transfer();
+      value = hdma_transfer(value);
     }
 
-    io.at(address - 0xff00) = value;
+    io[address - 0xff00] = value;
+
+    scheduler.reschedule();
+    side_effect_writes++;
   }
   else if (address >= 0xff80 && address < 0xffff)
   {
     // HRAM - High RAM
-    hram.at(address - 0xff80) = value;
+    hram[address - 0xff80] = value;
   }
   else if (address == 0xffff)
   {
     // Interrupt enable register
     interrupt_enable = value;
+    side_effect_writes++;
   }
   else
   {
@@ -187,37 +329,79 @@ void Memory::write_byte(uint address, u8 value)
 
 void Memory::direct_io_write8(uint address, u8 value)
 {
-  io.at(address - 0xff00) = value;
+  io[address - 0xff00] = value;
 }
 
-void Memory::dma_transfer(uint address)
+void Memory::copy(u8 *dest, uint source, uint length) const
 {
-  address <<= 8;
-  for (uint i=0; i<0xa0; i++)
+  // Copy whole pages at a time where they're mapped directly
+  while (length > 0)
   {
-    set8(0xfe00+i, get8(address+i));
+    uint chunk = std::min(length, page_size - (source & 0xff));
+    const u8 *page = read_pages[(source >> 8) & 0xff];
+    if (page)
+    {
+      memcpy(dest, page + (source & 0xff), chunk);
+    }
+    else
+    {
+      for (uint i=0; i<chunk; i++)
+      {
+        dest[i] = read_byte((source + i) & 0xffff);
+      }
+    }
+    dest += chunk;
+    source += chunk;
+    length -= chunk;
   }
 }
 
-void Memory::hdma_transfer()
+void Memory::dma_transfer(uint address)
+{
+  copy(&oam[0], address << 8, 0xa0);
+}
+
+u8 Memory::hdma_transfer(u8 HDMA5)
 {
-  uint source_high = read_byte(IO::HDMA1);
-  uint source_low  = read_byte(IO::HDMA2);
-  uint dest_high   = read_byte(IO::HDMA3);
-  uint dest_low    = read_byte(IO::HDMA4);
+  if (hdma_blocks > 0 && !(HDMA5 & 0x80))
+  {
+    // Stop the H-Blank DMA in progress
+    u8 remaining = 0x80 | (hdma_blocks - 1);
+    hdma_blocks = 0;
+    return remaining;
+  }
 
-  // TODO check address are in range
-  uint source = source_high << 8 | source_low;
-  uint dest = 0x8000 + (dest_high << 8 | dest_low);
+  hdma_source = (io[IO::HDMA1 - 0xff00] << 8 | io[IO::HDMA2 - 0xff00]) & 0xfff0;
+  hdma_dest = ((io[IO::HDMA3 - 0xff00] << 8 | io[IO::HDMA4 - 0xff00]) & 0x1ff0);
+  hdma_blocks = (HDMA5 & 0x7f) + 1;
 
-  // TODO support for H-Blank DMA
-  uint HDMA5 = read_byte(IO::HDMA5);
-  uint transfer_length = HDMA5 & 0x7f;
-  for (uint i=0; i<transfer_length; i++)
+  if (HDMA5 & 0x80)
   {
-    write_byte(dest+i, read_byte(source+i));
+    // H-Blank DMA - the display copies a block at the start of each H-Blank
+    return hdma_blocks - 1;
   }
 
-  HDMA5 &= 0xfe; // Clear last bit to show HDMA has finished
-  direct_io_write8(IO::HDMA5, HDMA5);
+  // General purpose DMA - copy everything at once
+  while (hdma_blocks > 0)
+  {
+    hdma_copy_block();
+  }
+  return 0xff;
+}
+
+void Memory::hblank_dma()
+{
+  if (hdma_blocks > 0)
+  {
+    hdma_copy_block();
+    direct_io_write8(IO::HDMA5, hdma_blocks > 0 ? hdma_blocks - 1 : 0xff);
+  }
+}
+
+void Memory::hdma_copy_block()
+{
+  copy(&vram[active_vram_bank*0x2000 + hdma_dest], hdma_source, 0x10);
+  hdma_source = (hdma_source + 0x10) & 0xffff;
+  hdma_dest = (hdma_dest + 0x10) & 0x1fff;
+  hdma_blocks--;
 }
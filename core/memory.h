@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include "types.h"
 
@@ -7,6 +8,10 @@ class Cartridge;
 class Joypad;
 class Audio;
 class Display;
+class Timer;
+class Scheduler;
+class StateWriter;
+class StateReader;
 
 class Memory
 {
@@ -18,15 +23,30 @@ public:
   } gb_version;
 
   Memory() = delete;
-  explicit Memory(Cartridge &cartridge, Joypad &j, Audio &a, Display &d);
+  explicit Memory(Cartridge &cartridge, Joypad &j, Audio &a, Display &d, Timer &t, Scheduler &s);
 
   void set8(uint address, u8 value)
   {
-    write_byte(address, value);
+    address &= 0xffff;
+    u8 *page = write_pages[address >> 8];
+    if (page)
+    {
+      page[address & 0xff] = value;
+    }
+    else
+    {
+      write_byte(address, value);
+    }
   }
 
   u8 get8(uint address) const
   {
+    address &= 0xffff;
+    const u8 *page = read_pages[address >> 8];
+    if (page)
+    {
+      return page[address & 0xff];
+    }
     return read_byte(address);
   }
 
@@ -35,22 +55,65 @@ public:
     return read_byte(address, vram_bank);
   }
 
+  // A whole VRAM bank, for the display to read tiles from. Index 0 is 0x8000.
+  const u8 *get_vram(uint vram_bank) const { return &vram[vram_bank*0x2000]; }
+
   void set16(uint address, u16 value)
   {
     u8 upper = (value & 0xff00) >> 8;
     u8 lower = (value & 0x00ff);
-    write_byte(address, lower);
-    write_byte(address+1, upper);
+    set8(address, lower);
+    set8(address+1, upper);
   }
 
   u16 get16(uint address) const
   {
-    u8 lower = read_byte(address);
-    u8 upper = read_byte(address+1);
+    u8 lower = get8(address);
+    u8 upper = get8(address+1);
     u16 value = (upper << 8) | lower;
     return value;
   }
 
+  // Update the pages mapped to the cartridge after its banks are switched
+  void map_cartridge();
+
+  // Copy the next block of an H-Blank DMA, called by the display as each
+  // visible line enters H-Blank
+  bool hblank_dma_active() const { return hdma_blocks > 0; }
+  void hblank_dma();
+
+  // Host memory the instruction at address is read from, for the CPU's block
+  // cache. Returns nullptr if code there can't be cached.
+  const u8 *get_code(uint address) const
+  {
+    address &= 0xffff;
+    const u8 *page = read_pages[address >> 8];
+    if (page && (address < 0x8000 || (address >= 0xc000 && address < 0xfe00)))
+    {
+      return page + (address & 0xff);
+    }
+    return nullptr;
+  }
+
+  // Send writes to the work RAM page holding address through write_byte, so
+  // code cached from it can be invalidated. Returns the page's generation,
+  // which changes whenever it's written, or nullptr if the page is written
+  // to too often to be worth caching.
+  const u32 *protect_code(uint address);
+
+  // Counts writes which may raise an interrupt or change cached code
+  u32 get_side_effect_writes() const { return side_effect_writes; }
+
+  // How many cycles values read since reset_stable_reads() will stay the
+  // same for. Registers such as STAT and DIV change without anything being
+  // scheduled, so loops polling them can only be skipped this far ahead.
+  static const uint always_stable = 0xffffffff;
+  void reset_stable_reads() { stable_cycles = always_stable; }
+  uint get_stable_cycles() const { return stable_cycles; }
+
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
+
   // Used to directly set the memory at a given address
   // without value being manipulated first
   void direct_io_write8(uint address, u8 value);
@@ -153,13 +216,22 @@ private:
   u8 read_byte(uint address) const;
   u8 read_byte(uint address, uint vram_bank) const;
   void write_byte(uint address, u8 value);
+  void copy(u8 *dest, uint source, uint length) const;
   void dma_transfer(uint address);
-  void hdma_transfer();
+  u8 hdma_transfer(u8 HDMA5);
+  void hdma_copy_block();
+
+  void map_pages(uint address, uint size, const u8 *read, u8 *write);
+  void map_vram();
+  void map_wram();
+  uint wram_page(uint address) const;
 
   Cartridge &cart;
   Joypad &joypad;
   Audio &audio;
   Display &display;
+  Timer &timer;
+  Scheduler &scheduler;
 
   std::vector<u8> vram = std::vector<u8>(0x4000);
   std::vector<u8> wram = std::vector<u8>(0x8000);
@@ -170,4 +242,28 @@ private:
 
   uint active_vram_bank = 0;
   uint active_wram_bank = 1;
+
+  // H-Blank DMA in progress, copying 16 byte blocks from hdma_source to
+  // hdma_dest in VRAM
+  uint hdma_source = 0;
+  uint hdma_dest = 0;
+  uint hdma_blocks = 0;
+
+  // Direct pointers to the memory backing each 256 byte page of the address
+  // space. Pages are set to nullptr when accesses to them have side effects
+  // and must go through read_byte/write_byte instead.
+  static const uint page_size = 0x100;
+  const u8 *read_pages[0x100] = {};
+  u8 *write_pages[0x100] = {};
+
+  // Work RAM pages holding cached code, see protect_code()
+  static const uint wram_pages = 0x80;
+  static const uint max_code_invalidations = 32;
+  bool wram_code[wram_pages] = {};
+  u32 wram_generation[wram_pages] = {};
+  uint wram_invalidations[wram_pages] = {};
+
+  u32 side_effect_writes = 0;
+  mutable uint stable_cycles = always_stable;
+  void stable_for(uint cycles) const { stable_cycles = std::min(stable_cycles, cycles); }
 };
@@ -0,0 +1,233 @@
+#include "rewind.h"
+#include "gameboy.h"
+
+#include <string.h>
+
+static u8 *write_varint(u8 *out, size_t value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+static size_t read_varint(const std::vector<u8> &in, size_t &pos)
+{
+  size_t value = 0;
+  uint shift = 0;
+  while (pos < in.size())
+  {
+    u8 byte = in[pos++];
+    value |= static_cast<size_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      break;
+    shift += 7;
+  }
+  return value;
+}
+
+void Rewind::capture(const Gameboy &gb)
+{
+  gb.save_state(state, false);
+
+  if (history.empty() ||
+      history.back().deltas.size() + 1 >= keyframe_interval ||
+      history.back().keyframe.size() != state.size())
+  {
+    // Start a new group
+    history.emplace_back();
+    history.back().keyframe = state;
+    memory_used += state.size();
+  }
+  else
+  {
+    Group &group = history.back();
+    encode(group.keyframe, state, delta);
+    group.deltas.emplace_back(delta.begin(), delta.end());
+    memory_used += delta.size();
+  }
+
+  frames++;
+  enforce_budget();
+}
+
+bool Rewind::rewind(Gameboy &gb)
+{
+  if (history.empty())
+    return false;
+
+  bool redraw = decode_previous(previous);
+
+  Group &group = history.back();
+  if (group.deltas.empty())
+  {
+    // Only the keyframe is left - this group is finished with
+    state.swap(group.keyframe);
+    memory_used -= state.size();
+    history.pop_back();
+  }
+  else
+  {
+    decode(group.keyframe, group.deltas.back(), state);
+    memory_used -= group.deltas.back().size();
+    group.deltas.pop_back();
+  }
+  frames--;
+
+  // Draw the frame by running on from the state before it, then restore the
+  // state itself, in case input made the frame play out any differently.
+  // The oldest frame has nothing before it, so the last frame drawn stays.
+  // Replayed frames are silent, as their sound would play out of order.
+  if (redraw && gb.load_state(previous, false))
+  {
+    bool muted = gb.is_muted();
+    gb.set_muted(true);
+    gb.run_to_vblank();
+    gb.set_muted(muted);
+  }
+  return gb.load_state(state, false);
+}
+
+bool Rewind::decode_previous(std::vector<u8> &state) const
+{
+  const Group &group = history.back();
+  if (group.deltas.size() >= 2)
+  {
+    decode(group.keyframe, group.deltas[group.deltas.size() - 2], state);
+    return true;
+  }
+  if (group.deltas.size() == 1)
+  {
+    state = group.keyframe;
+    return true;
+  }
+  if (history.size() < 2)
+  {
+    return false;
+  }
+
+  const Group &before = history[history.size() - 2];
+  if (before.deltas.empty())
+  {
+    state = before.keyframe;
+  }
+  else
+  {
+    decode(before.keyframe, before.deltas.back(), state);
+  }
+  return true;
+}
+
+void Rewind::clear()
+{
+  history.clear();
+  memory_used = 0;
+  frames = 0;
+}
+
+void Rewind::set_max_memory(size_t max_memory_)
+{
+  max_memory = max_memory_;
+  enforce_budget();
+}
+
+void Rewind::drop_oldest()
+{
+  Group &group = history.front();
+  memory_used -= group.keyframe.size();
+  for (const std::vector<u8> &d : group.deltas)
+  {
+    memory_used -= d.size();
+  }
+  frames -= group.deltas.size() + 1;
+  history.pop_front();
+}
+
+void Rewind::enforce_budget()
+{
+  while (memory_used > max_memory && !history.empty())
+  {
+    drop_oldest();
+  }
+}
+
+static inline u64 load64(const u8 *p)
+{
+  u64 value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Deltas are a sequence of:
+//   varint  number of bytes unchanged from the keyframe
+//   varint  number of changed bytes, n
+//   n bytes XOR of the changed bytes with the keyframe
+//
+// The state is compared a word at a time, so runs are multiples of 8 bytes
+// apart from the tail which is always stored.
+void Rewind::encode(const std::vector<u8> &keyframe, const std::vector<u8> &state,
+                    std::vector<u8> &delta)
+{
+  // Worst case is every byte changed plus the counts
+  const size_t size = state.size();
+  delta.resize(size + 32);
+
+  const u8 *s = state.data();
+  const u8 *k = keyframe.data();
+  u8 *out = delta.data();
+
+  const size_t end = size & ~size_t(7);
+  size_t i = 0;
+  while (i < end)
+  {
+    size_t unchanged_start = i;
+    while (i < end && load64(s + i) == load64(k + i))
+      i += 8;
+
+    size_t changed_start = i;
+    while (i < end && load64(s + i) != load64(k + i))
+      i += 8;
+
+    out = write_varint(out, changed_start - unchanged_start);
+    out = write_varint(out, i - changed_start);
+    for (size_t j=changed_start; j<i; j+=8)
+    {
+      u64 x = load64(s + j) ^ load64(k + j);
+      memcpy(out, &x, sizeof(x));
+      out += 8;
+    }
+  }
+
+  if (end < size)
+  {
+    out = write_varint(out, 0);
+    out = write_varint(out, size - end);
+    for (size_t j=end; j<size; j++)
+    {
+      *out++ = s[j] ^ k[j];
+    }
+  }
+
+  delta.resize(out - delta.data());
+}
+
+void Rewind::decode(const std::vector<u8> &keyframe, const std::vector<u8> &delta,
+                    std::vector<u8> &state)
+{
+  state = keyframe;
+
+  size_t pos = 0;
+  size_t i = 0;
+  while (pos < delta.size())
+  {
+    i += read_varint(delta, pos);
+    size_t changed = read_varint(delta, pos);
+    for (size_t j=0; j<changed && i < state.size() && pos < delta.size(); j++)
+    {
+      state[i++] ^= delta[pos++];
+    }
+  }
+}
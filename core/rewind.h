@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include "types.h"
+
+class Gameboy;
+
+// History of recent save states, so emulation can be stepped backwards one
+// frame at a time.
+//
+// States are stored in groups: the first state in a group is kept whole as
+// a keyframe and the rest are stored as run length encoded XORs against it.
+// When the history grows beyond its memory budget the oldest group is dropped.
+//
+// The framebuffer is left out of the states, as it changes far more from
+// frame to frame than the rest. Each frame is redrawn when it's rewound to,
+// by running on to it from the state before.
+class Rewind
+{
+public:
+  Rewind() = delete;
+  explicit Rewind(size_t max_memory_, uint keyframe_interval_ = 60)
+    : max_memory(max_memory_), keyframe_interval(keyframe_interval_) { }
+
+  // Record the current state, typically once per frame
+  void capture(const Gameboy &gb);
+
+  // Restore the most recently captured state and remove it from the history.
+  // Returns false if there is nothing left to rewind to.
+  bool rewind(Gameboy &gb);
+
+  void clear();
+
+  void set_max_memory(size_t max_memory_);
+  size_t get_memory_used() const { return memory_used; }
+  size_t get_frames() const { return frames; }
+
+private:
+  struct Group
+  {
+    std::vector<u8> keyframe;
+    std::vector<std::vector<u8>> deltas;
+  };
+
+  std::deque<Group> history;
+
+  size_t max_memory;
+  size_t memory_used = 0;
+  size_t frames = 0;
+  uint keyframe_interval;
+
+  // Scratch buffers reused between frames
+  std::vector<u8> state;
+  std::vector<u8> previous;
+  std::vector<u8> delta;
+
+  // Decodes the state captured before the latest one, if there is one
+  bool decode_previous(std::vector<u8> &state) const;
+
+  static void encode(const std::vector<u8> &keyframe, const std::vector<u8> &state,
+                     std::vector<u8> &delta);
+  static void decode(const std::vector<u8> &keyframe, const std::vector<u8> &delta,
+                     std::vector<u8> &state);
+
+  void drop_oldest();
+  void enforce_budget();
+};
@@ -0,0 +1,107 @@
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GB_HAVE_MMAP 1
+#else
+#define GB_HAVE_MMAP 0
+#endif
+
+#include "rom_image.h"
+
+std::shared_ptr<const RomImage> RomImage::create(std::vector<u8> data)
+{
+  std::shared_ptr<RomImage> image(new RomImage);
+  image->copy = std::move(data);
+  image->bytes = image->copy.data();
+  image->length = image->copy.size();
+  return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::read(std::istream &stream)
+{
+  return create(std::vector<u8>(std::istreambuf_iterator<char>(stream),
+                                std::istreambuf_iterator<char>()));
+}
+
+RomImage::~RomImage()
+{
+#if GB_HAVE_MMAP
+  if (mapping)
+  {
+    munmap(mapping, length);
+  }
+#endif
+}
+
+#if GB_HAVE_MMAP
+
+std::shared_ptr<const RomImage> RomImage::map(const std::string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  // Files are identified by inode rather than path, and a file which has
+  // changed since it was mapped gets a mapping of its own
+  using Key = std::tuple<dev_t, ino_t, off_t, time_t>;
+  static std::mutex mutex;
+  static std::map<Key, std::weak_ptr<const RomImage>> mapped;
+
+  Key key(st.st_dev, st.st_ino, st.st_size, st.st_mtime);
+  std::lock_guard<std::mutex> lock(mutex);
+  if (std::shared_ptr<const RomImage> image = mapped[key].lock())
+  {
+    close(fd);
+    return image;
+  }
+
+  void *mapping = st.st_size > 0 ?
+    mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    // Not something which can be mapped, such as a pipe
+    std::ifstream stream(path, std::ios::binary);
+    return read(stream);
+  }
+
+  std::shared_ptr<RomImage> image(new RomImage);
+  image->mapping = mapping;
+  image->bytes = static_cast<const u8 *>(mapping);
+  image->length = st.st_size;
+
+  // Forget about mappings which have since been released
+  for (auto it = mapped.begin(); it != mapped.end(); )
+  {
+    it = it->second.expired() ? mapped.erase(it) : std::next(it);
+  }
+  mapped[key] = image;
+  return image;
+}
+
+#else
+
+std::shared_ptr<const RomImage> RomImage::map(const std::string &path)
+{
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream.is_open())
+    return nullptr;
+  return read(stream);
+}
+
+#endif
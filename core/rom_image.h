@@ -0,0 +1,39 @@
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "types.h"
+
+// The contents of a ROM file. ROMs are never written to, so one RomImage can
+// be shared by any number of Gameboys running the same game.
+class RomImage
+{
+public:
+  // Takes ownership of a ROM already in memory
+  static std::shared_ptr<const RomImage> create(std::vector<u8> data);
+  // Copies a whole ROM from a stream
+  static std::shared_ptr<const RomImage> read(std::istream &stream);
+  // Maps a ROM file read only, so only the parts of it which are used are
+  // ever loaded. Mapping a file which is already mapped shares the existing
+  // mapping. Returns nullptr if the file can't be opened.
+  static std::shared_ptr<const RomImage> map(const std::string &path);
+
+  RomImage(const RomImage &) = delete;
+  RomImage &operator=(const RomImage &) = delete;
+  ~RomImage();
+
+  const u8 *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  RomImage() = default;
+
+  const u8 *bytes = nullptr;
+  size_t length = 0;
+
+  // Where the ROM is held: either copied into memory, or mapped from a file
+  std::vector<u8> copy;
+  void *mapping = nullptr;
+};
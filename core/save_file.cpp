@@ -0,0 +1,131 @@
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GB_HAVE_MMAP 1
+#else
+#define GB_HAVE_MMAP 0
+#endif
+
+#include "save_file.h"
+
+// How often dirty parts of the file are written out, if nothing asks sooner
+static const auto flush_interval = std::chrono::seconds(1);
+
+#if GB_HAVE_MMAP
+
+std::unique_ptr<SaveFile> SaveFile::open(const std::string &path, const u8 *initial, uint size)
+{
+  if (size == 0)
+    return nullptr;
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (st.st_size < static_cast<off_t>(size) && ftruncate(fd, size) != 0))
+  {
+    ::close(fd);
+    return nullptr;
+  }
+
+  void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+
+  std::unique_ptr<SaveFile> file(new SaveFile);
+  file->ram = static_cast<u8 *>(mapping);
+  file->length = size;
+
+  // Fill in whatever the file was too short to hold
+  uint existing = std::min<uint>(st.st_size, size);
+  if (existing < size)
+  {
+    memcpy(file->ram + existing, initial + existing, size - existing);
+    file->mark_dirty(existing, size - existing);
+  }
+
+  file->flusher = std::thread(&SaveFile::flush_thread, file.get());
+  return file;
+}
+
+SaveFile::~SaveFile()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  flusher.join();
+
+  flush();
+  munmap(ram, length);
+}
+
+void SaveFile::flush()
+{
+  // Whatever is writable may have changed since the last flush, whether or
+  // not it was marked
+  u32 chunks = dirty.exchange(0, std::memory_order_relaxed) |
+               writable.load(std::memory_order_relaxed);
+
+  // msync() needs page aligned addresses, and pages may be bigger than chunks
+  const uint page_size = sysconf(_SC_PAGESIZE);
+  for (uint chunk = 0; chunks; chunk++, chunks >>= 1)
+  {
+    if (!(chunks & 1))
+      continue;
+    uint start = chunk * chunk_size;
+    uint end = std::min(start + chunk_size, length);
+    start -= start % page_size;
+    msync(ram + start, end - start, MS_SYNC);
+  }
+}
+
+#else
+
+std::unique_ptr<SaveFile> SaveFile::open(const std::string &, const u8 *, uint)
+{
+  return nullptr;
+}
+
+SaveFile::~SaveFile()
+{
+}
+
+void SaveFile::flush()
+{
+}
+
+#endif
+
+void SaveFile::flush_soon()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    flush_requested = true;
+  }
+  wake.notify_one();
+}
+
+void SaveFile::flush_thread()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping)
+  {
+    wake.wait_for(lock, flush_interval, [this]() { return stopping || flush_requested; });
+    flush_requested = false;
+
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
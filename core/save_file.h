@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "types.h"
+
+// Cartridge RAM kept in a memory mapped save file. Writes land straight in
+// the OS's copy of the file, so they survive the emulator crashing, and a
+// background thread writes the parts which have changed out to disk without
+// ever holding up the emulator.
+class SaveFile
+{
+public:
+  // Maps the first size bytes of a save file, creating it if needed. Any of
+  // those bytes which aren't in the file yet start out as the matching bytes
+  // of initial. Returns nullptr if the file can't be mapped.
+  static std::unique_ptr<SaveFile> open(const std::string &path, const u8 *initial, uint size);
+
+  SaveFile(const SaveFile &) = delete;
+  SaveFile &operator=(const SaveFile &) = delete;
+  // Writes out anything still dirty before unmapping
+  ~SaveFile();
+
+  u8 *data() const { return ram; }
+  uint size() const { return length; }
+
+  // Called whenever the emulator may write to part of the file. Only one
+  // range can be writable at a time, and it's flushed for as long as it is
+  // writable, as well as once after, since writes to it aren't seen.
+  // Pass a size of 0 once nothing is writable.
+  void set_writable(uint offset, uint size)
+  {
+    u32 chunks = chunks_in(offset, size);
+    dirty.fetch_or(writable.exchange(chunks, std::memory_order_relaxed) | chunks,
+                   std::memory_order_relaxed);
+  }
+
+  void mark_dirty(uint offset, uint size)
+  {
+    dirty.fetch_or(chunks_in(offset, size), std::memory_order_relaxed);
+  }
+
+  // Asks for dirty parts to be written out now, rather than waiting for
+  // the next periodic flush
+  void flush_soon();
+
+private:
+  SaveFile() = default;
+
+  // Dirty parts are tracked in chunks of the size of a RAM bank. 32 of them
+  // cover the largest cartridge RAM there is.
+  static const uint chunk_size = 0x2000;
+
+  static u32 chunks_in(uint offset, uint size)
+  {
+    if (size == 0)
+      return 0;
+    uint first = offset / chunk_size;
+    uint last = (offset + size - 1) / chunk_size;
+    return (last - first == 31) ? ~0u : ((1u << (last - first + 1)) - 1) << first;
+  }
+
+  void flush_thread();
+  void flush();
+
+  u8 *ram = nullptr;
+  uint length = 0;
+
+  std::atomic<u32> dirty{0};
+  std::atomic<u32> writable{0};
+
+  std::thread flusher;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool flush_requested = false;
+  bool stopping = false;
+};
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "display.h"
+#include "timer.h"
+#include "audio.h"
+#include "state.h"
+
+void Scheduler::run_events()
+{
+  for (int i=0; i<Component::COUNT; i++)
+  {
+    Component::Type component = static_cast<Component::Type>(i);
+    if (next_update[component] <= now)
+    {
+      update(component);
+      next_update[component] = now + cycles_until_update(component);
+    }
+  }
+
+  update_next_event();
+}
+
+void Scheduler::sync()
+{
+  for (int i=0; i<Component::COUNT; i++)
+  {
+    update(static_cast<Component::Type>(i));
+  }
+}
+
+void Scheduler::reschedule()
+{
+  for (int i=0; i<Component::COUNT; i++)
+  {
+    Component::Type component = static_cast<Component::Type>(i);
+    next_update[component] = last_update[component] + cycles_until_update(component);
+  }
+
+  update_next_event();
+}
+
+void Scheduler::save_state(StateWriter &state) const
+{
+  state.write(now);
+  state.write(last_update);
+}
+
+void Scheduler::load_state(StateReader &state)
+{
+  state.read(now);
+  state.read(last_update);
+
+  // Components may have been due at different times in the restored state
+  reschedule();
+}
+
+void Scheduler::update(Component::Type component)
+{
+  uint cycles = now - last_update[component];
+  last_update[component] = now;
+  if (cycles == 0)
+  {
+    return;
+  }
+
+  switch (component)
+  {
+    case Component::DISPLAY:
+      display.update(cycles);
+      break;
+    case Component::TIMER:
+      timer.update(cycles);
+      break;
+    case Component::AUDIO:
+      audio.update(cycles);
+      break;
+    case Component::COUNT:
+    default:
+      abort();
+  }
+}
+
+uint Scheduler::cycles_until_update(Component::Type component) const
+{
+  switch (component)
+  {
+    case Component::DISPLAY:
+      return display.cycles_until_update();
+    case Component::TIMER:
+      return timer.cycles_until_update();
+    case Component::AUDIO:
+      return audio.cycles_until_update();
+    case Component::COUNT:
+    default:
+      abort();
+  }
+}
+
+void Scheduler::update_next_event()
+{
+  next_event = next_update[0];
+  for (int i=1; i<Component::COUNT; i++)
+  {
+    if (next_update[i] < next_event)
+    {
+      next_event = next_update[i];
+    }
+  }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "types.h"
+
+class Display;
+class Timer;
+class Audio;
+class StateWriter;
+class StateReader;
+
+// Keeps track of when each component next needs to be updated, so that the
+// CPU can run instructions back to back until the earliest of them is due
+class Scheduler
+{
+public:
+  Scheduler() = delete;
+  explicit Scheduler(Display &d, Timer &t, Audio &a) : display(d), timer(t), audio(a) { }
+
+  // Returned from a component's cycles_until_update() when nothing will
+  // happen until one of its registers is written to
+  static const uint no_event = 0xffffffff;
+
+  // Move time forward after executing an instruction. Returns true if any
+  // components were updated.
+  bool step(uint cycles)
+  {
+    now += cycles;
+    if (now >= next_event)
+    {
+      run_events();
+      return true;
+    }
+    return false;
+  }
+
+  // Bring every component up to date, e.g. before changing a register
+  void sync();
+
+  // Recalculate when each component is next due, e.g. after changing a register
+  void reschedule();
+
+  u64 get_cycles() const { return now; }
+
+  // Cycles until the first component is due, e.g. to skip time spent waiting
+  // for an interrupt. Capped, as nothing may be due at all.
+  static const uint max_skip = 0x10000;
+  uint cycles_until_event() const
+  {
+    u64 cycles = next_event > now ? next_event - now : 0;
+    return cycles < max_skip ? cycles : max_skip;
+  }
+
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
+
+private:
+  Display &display;
+  Timer &timer;
+  Audio &audio;
+
+  struct Component
+  {
+    enum Type
+    {
+      DISPLAY = 0,
+      TIMER,
+      AUDIO,
+      COUNT,
+    };
+  };
+
+  // Total number of cycles executed
+  u64 now = 0;
+
+  // Time at which the first of the components needs updating
+  u64 next_event = 0;
+
+  u64 last_update[Component::COUNT] = {};
+  u64 next_update[Component::COUNT] = {};
+
+  void run_events();
+  void update(Component::Type component);
+  uint cycles_until_update(Component::Type component) const;
+  void update_next_event();
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// A fixed size queue which one thread pushes to while another pops from it,
+// without either ever waiting on a lock. Items stay in their slots, so large
+// ones can be filled in through back() and read through front() in place,
+// with push() and pop() handing them over.
+template <typename T, size_t Capacity>
+class SPSCQueue
+{
+  static_assert(Capacity && (Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of 2");
+
+public:
+  // Producer: the slot the next item goes in, or nullptr if the queue is full
+  T *back()
+  {
+    size_t tail = tail_index.load(std::memory_order_relaxed);
+    if (tail - head_index.load(std::memory_order_acquire) == Capacity)
+      return nullptr;
+    return &items[tail % Capacity];
+  }
+
+  // Producer: hands the item filled in through back() to the consumer
+  void push()
+  {
+    tail_index.store(tail_index.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool push(const T &item)
+  {
+    T *slot = back();
+    if (!slot)
+      return false;
+    *slot = item;
+    push();
+    return true;
+  }
+
+  // Producer: copies in as many of count items as fit, returning how many
+  size_t push(const T *items, size_t count)
+  {
+    size_t tail = tail_index.load(std::memory_order_relaxed);
+    size_t space = Capacity - (tail - head_index.load(std::memory_order_acquire));
+    if (count > space)
+      count = space;
+    for (size_t i = 0; i < count; i++)
+      this->items[(tail + i) % Capacity] = items[i];
+    tail_index.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer: the oldest item, or nullptr if the queue is empty
+  T *front()
+  {
+    size_t head = head_index.load(std::memory_order_relaxed);
+    if (head == tail_index.load(std::memory_order_acquire))
+      return nullptr;
+    return &items[head % Capacity];
+  }
+
+  // Consumer: hands the front() slot back to the producer
+  void pop()
+  {
+    head_index.store(head_index.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Consumer: copies out up to count of the oldest items, returning how many
+  size_t pop(T *items, size_t count)
+  {
+    size_t head = head_index.load(std::memory_order_relaxed);
+    size_t available = tail_index.load(std::memory_order_acquire) - head;
+    if (count > available)
+      count = available;
+    for (size_t i = 0; i < count; i++)
+      items[i] = this->items[(head + i) % Capacity];
+    head_index.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  // Either thread: how many items are queued, which the other thread may
+  // change at any moment
+  size_t size() const
+  {
+    // Reading head first means it can't have overtaken the tail read after
+    size_t head = head_index.load(std::memory_order_acquire);
+    return tail_index.load(std::memory_order_acquire) - head;
+  }
+
+private:
+  T items[Capacity];
+
+  // Kept on separate cache lines, as each is written by a different thread
+  alignas(64) std::atomic<size_t> head_index{0};
+  alignas(64) std::atomic<size_t> tail_index{0};
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string.h>
+#include <type_traits>
+#include <vector>
+#include "types.h"
+
+// Appends the raw bytes of each value to a save state buffer
+class StateWriter
+{
+  std::vector<u8> &buffer;
+
+public:
+  StateWriter() = delete;
+  explicit StateWriter(std::vector<u8> &buf) : buffer(buf) { }
+
+  void write(const void *data, size_t size)
+  {
+    const u8 *bytes = static_cast<const u8 *>(data);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+  }
+
+  template <typename T>
+  void write(const T &value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only plain data can be written directly");
+    write(&value, sizeof(value));
+  }
+
+  // Buffers are written along with their size
+  void write_buffer(const void *data, u32 size)
+  {
+    write(size);
+    write(data, size);
+  }
+
+  void write(const std::vector<u8> &data)
+  {
+    write_buffer(data.data(), data.size());
+  }
+};
+
+// Reads values back in the order they were written by StateWriter.
+// Once a read runs past the end of the buffer, or a vector's size doesn't
+// match, every following read fails and ok() returns false.
+class StateReader
+{
+  const std::vector<u8> &buffer;
+  size_t position = 0;
+  bool valid = true;
+
+public:
+  StateReader() = delete;
+  explicit StateReader(const std::vector<u8> &buf) : buffer(buf) { }
+
+  bool ok() const { return valid; }
+  size_t remaining() const { return buffer.size() - position; }
+
+  void read(void *data, size_t size)
+  {
+    if (!valid || size > remaining())
+    {
+      valid = false;
+      return;
+    }
+    memcpy(data, buffer.data() + position, size);
+    position += size;
+  }
+
+  template <typename T>
+  void read(T &value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only plain data can be read directly");
+    read(&value, sizeof(value));
+  }
+
+  // Buffers and vectors are restored in place and must already be the saved size
+  void read_buffer(void *data, u32 size)
+  {
+    u32 saved_size = 0;
+    read(saved_size);
+    if (saved_size != size)
+    {
+      valid = false;
+      return;
+    }
+    read(data, size);
+  }
+
+  void read(std::vector<u8> &data)
+  {
+    read_buffer(data.data(), data.size());
+  }
+};
@@ -1,82 +1,149 @@
+#include <stdlib.h>
+
 #include "timer.h"
 #include "lr35902.h"
 #include "memory.h"
+#include "scheduler.h"
+#include "state.h"
 
 void Timer::update(uint cycles)
 {
-  update_divider(cycles);
-
   if (timer_enabled())
   {
-    // Should this be here, or updated when TAC is written to in Memory?
-    // Only update the frequency when counter reaches 0 / set counter to zero
-    // when we update the frequency?
-    update_clock_freq();
-
     if (interrupt_pending)
     {
       // An overflow occured on the previous cycle
       // Reset TIMA and raise an interrupt
-      memory.set8(Memory::IO::TIMA, memory.get8(Memory::IO::TMA));
+      tima = tma;
       cpu.raise_interrupt(LR35902::Interrupt::TIMER);
       interrupt_pending = false;
     }
 
-    counter -= cycles;
-
-    if (counter <= 0)
+    // Count the falling edges of the selected divider bit
+    uint period = cycles_per_tick();
+    uint ticks = ((divider & (period - 1)) + cycles) / period;
+    if (tima + ticks > 0xff)
     {
-      counter += cycles_per_tick;
-
-      u8 TIMA = memory.get8(Memory::IO::TIMA);
-      if (TIMA == 0xff)
-      {
-        // Overflow - raise an interrupt and reset TIMA on the next cycle
-        interrupt_pending = true;
-      }
-      // 8-bit overflow expected:
-      memory.set8(Memory::IO::TIMA, TIMA+1);
+      // Overflow - raise an interrupt and reset TIMA on the next cycle
+      interrupt_pending = true;
     }
+    // 8-bit overflow expected:
+    tima += ticks;
   }
+
+  divider += cycles;
 }
 
-void Timer::update_divider(uint cycles)
+uint Timer::cycles_until_update() const
 {
-  divider_counter -= cycles;
+  if (!timer_enabled())
+  {
+    // DIV is worked out when it's read
+    return Scheduler::no_event;
+  }
 
-  if (divider_counter <= 0)
+  if (interrupt_pending)
   {
-    divider_counter += divider_cycles_per_tick;
+    // Handle the overflow straight after the next instruction
+    return 1;
+  }
 
-    // 8-bit overflow expected:
-    memory.direct_io_write8(Memory::IO::DIV, memory.get8(Memory::IO::DIV)+1);
+  // Update when TIMA next overflows
+  uint period = cycles_per_tick();
+  return (period - (divider & (period - 1))) + (0xff - tima) * period;
+}
+
+u8 Timer::read_byte(uint address) const
+{
+  switch (address)
+  {
+    case Memory::IO::DIV:
+      return divider >> 8;
+    case Memory::IO::TIMA:
+      return tima;
+    case Memory::IO::TMA:
+      return tma;
+    case Memory::IO::TAC:
+      return tac;
+    default:
+      abort();
+  }
+}
+
+uint Timer::cycles_until_change(uint address) const
+{
+  switch (address)
+  {
+    case Memory::IO::DIV:
+      return 0x100 - (divider & 0xff);
+    case Memory::IO::TIMA:
+      if (timer_enabled())
+      {
+        return cycles_per_tick() - (divider & (cycles_per_tick() - 1));
+      }
+      return Memory::always_stable;
+    default:
+      return Memory::always_stable;
   }
 }
 
-bool Timer::timer_enabled() const
+void Timer::write_byte(uint address, u8 value)
 {
-  u8 TAC = memory.get8(Memory::IO::TAC);
-  return TAC & 0x4;
+  switch (address)
+  {
+    case Memory::IO::DIV:
+      // Resetting the divider makes TIMA tick if the selected bit was set
+      if (timer_enabled() && (divider & (cycles_per_tick() / 2)))
+      {
+        tima++;
+        interrupt_pending |= (tima == 0);
+      }
+      divider = 0;
+      break;
+    case Memory::IO::TIMA:
+      tima = value;
+      break;
+    case Memory::IO::TMA:
+      tma = value;
+      break;
+    case Memory::IO::TAC:
+      tac = value;
+      break;
+    default:
+      abort();
+  }
 }
 
-void Timer::update_clock_freq()
+uint Timer::cycles_per_tick() const
 {
-  u8 TAC = memory.get8(Memory::IO::TAC);
-  switch (TAC & 0x3)
+  switch (tac & 0x3)
   {
     case 0:
-      cycles_per_tick = 1024; // 4 kHz
-      break;
+      return 1024; // 4 kHz
     case 1:
-      cycles_per_tick = 16; // 256 kHz
-      break;
+      return 16; // 256 kHz
     case 2:
-      cycles_per_tick = 64; // 64 kHz
-      break;
+      return 64; // 64 kHz
     case 3:
-      cycles_per_tick = 256; // 16 kHz
-      break;
     default:
-      break;
+      return 256; // 16 kHz
   }
 }
+
+void Timer::save_state(StateWriter &state) const
+{
+  state.write(divider);
+  state.write(tima);
+  state.write(tma);
+  state.write(tac);
+  state.write(interrupt_pending);
+}
+
+void Timer::load_state(StateReader &state)
+{
+  state.read(divider);
+  state.read(tima);
+  state.read(tma);
+  state.read(tac);
+  state.read(interrupt_pending);
+}
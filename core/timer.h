@@ -3,31 +3,42 @@
 #include "types.h"
 
 class LR35902;
-class Memory;
+class StateWriter;
+class StateReader;
 
+// DIV and TIMA are only brought up to date when they're read, written or
+// TIMA overflows, so the timer needs no updates in between
 class Timer
 {
   LR35902 &cpu;
-  Memory &memory;
 
-  static const uint clock_speed = 0x400000; // 4 MHz
-  static const uint divider_cycles_per_tick = clock_speed / 0x4000; // 16 kHz
-  uint cycles_per_tick = 1024;
+  // Internal 16 bit counter, incremented every cycle. DIV is its upper 8
+  // bits, and TIMA is incremented whenever the bit selected by TAC falls.
+  u16 divider = 0;
 
-  // Number of cycles remaining until we increment the timer
-  int counter = cycles_per_tick;
-  int divider_counter = divider_cycles_per_tick;
+  // Cached copies of the timer registers
+  u8 tima = 0;
+  u8 tma = 0;
+  u8 tac = 0;
 
   // Timer interrupt is delayed for 1 cycle after TIMA overflows
   bool interrupt_pending = false;
 
-  void update_divider(uint cycles);
-  bool timer_enabled() const;
-  void update_clock_freq();
+  bool timer_enabled() const { return tac & 0x4; }
+  uint cycles_per_tick() const;
 
 public:
   Timer() = delete;
-  explicit Timer(LR35902 &lr35902, Memory &mem) : cpu(lr35902), memory(mem) { }
+  explicit Timer(LR35902 &lr35902) : cpu(lr35902) { }
 
   void update(uint cycles);
+  uint cycles_until_update() const;
+
+  // DIV, TIMA, TMA and TAC. The timer must be up to date first.
+  u8 read_byte(uint address) const;
+  uint cycles_until_change(uint address) const;
+  void write_byte(uint address, u8 value);
+
+  void save_state(StateWriter &state) const;
+  void load_state(StateReader &state);
 };
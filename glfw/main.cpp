@@ -1,21 +1,27 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fstream>
 #include <string>
 
 #include "core/gameboy.h"
+#include "core/rewind.h"
+#include "openal.h"
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #endif
 
 static char *name;
-static std::string ram_file;
-Gameboy gb;
 
-void render_loop(Gameboy &gb);
+#ifdef __EMSCRIPTEN__
+// Emulator instance for the page's save_game() hook
+static Gameboy *emscripten_gb;
+#endif
+
+void render_loop(Gameboy &gb, unsigned int turbo_speed, Rewind *rewind, AudioOut *audio);
 
-void save_ram(void *ram, unsigned int size)
+void save_ram(const std::string &ram_file, void *ram, unsigned int size)
 {
   std::ofstream out(ram_file);
   out.write(reinterpret_cast<char *>(ram), size);
@@ -37,9 +43,16 @@ void usage()
   printf("Usage: %s [options] rom\n", name);
   printf("Options:\n");
   printf("  -o file               Save game output file\n");
+  printf("  -s                    Keep the save game in a memory mapped file, written out in the\n");
+  printf("                        background as the game saves\n");
   printf("  -d [all|cpu|audio]    Run in debug mode\n");
   printf("  -v [original|colour]  Select version of Gameboy to emulate\n");
   printf("  -m                    Mute audio\n");
+  printf("  -c                    Correct colours to look like a Gameboy Colour screen\n");
+  printf("  -t speed              Frames to run per displayed frame while turbo (tab) is held\n");
+  printf("                        (default: 0, as many as possible)\n");
+  printf("  -r megabytes          Memory to keep rewind history in, roughly 9 seconds\n");
+  printf("                        per megabyte, 0 to disable (default: 32)\n");
 }
 
 int main(int argc, char *argv[])
@@ -51,9 +64,16 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  Gameboy gb;
+  AudioOut audio_out;
+  std::string ram_file;
   bool ram_file_set = false;
+  bool map_save_file = false;
+  unsigned int turbo_speed = 0;
+  unsigned long rewind_megabytes = 32;
+  bool muted = false;
   int c;
-  while ((c = getopt(argc, argv, "d:v:o:m")) != -1)
+  while ((c = getopt(argc, argv, "d:v:o:smct:r:")) != -1)
   {
     switch (c)
     {
@@ -101,9 +121,38 @@ int main(int argc, char *argv[])
         ram_file = optarg;
         ram_file_set = true;
         break;
+      case 's':
+        map_save_file = true;
+        break;
       case 'm':
         gb.set_muted(true);
+        muted = true;
+        break;
+      case 'c':
+        gb.set_colour_correction(true);
+        break;
+      case 't':
+      {
+        char *end;
+        turbo_speed = strtoul(optarg, &end, 10);
+        if (*end != '\0')
+        {
+          fprintf(stderr, "Invalid turbo speed: '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      }
+      case 'r':
+      {
+        char *end;
+        rewind_megabytes = strtoul(optarg, &end, 10);
+        if (*end != '\0')
+        {
+          fprintf(stderr, "Invalid rewind memory size: '%s'\n", optarg);
+          return 1;
+        }
         break;
+      }
       default:
         usage();
         return 1;
@@ -137,9 +186,27 @@ int main(int argc, char *argv[])
   rom.close();
   ram.close();
 
-  gb.set_save_callback(&save_ram);
+  if (map_save_file && !gb.map_save_file(ram_file))
+  {
+    fprintf(stderr, "Couldn't map save file '%s', saving it normally\n", ram_file.c_str());
+    map_save_file = false;
+  }
+  if (!map_save_file)
+  {
+    gb.set_save_callback([ram_file](void *ram, unsigned int size)
+                         { save_ram(ram_file, ram, size); });
+  }
+  gb.set_audio_output(&audio_out);
+
+#ifdef __EMSCRIPTEN__
+  emscripten_gb = &gb;
+#endif
 
-  render_loop(gb);
+  Rewind rewind(rewind_megabytes << 20);
+  // Without any sound to keep pace with, frames are timed by the clock alone
+  bool audio_playing = audio_out.is_open() && !muted;
+  render_loop(gb, turbo_speed, rewind_megabytes ? &rewind : nullptr,
+              audio_playing ? &audio_out : nullptr);
 
   return 0;
 }
@@ -149,7 +216,7 @@ extern "C"
 {
   void save_game()
   {
-    gb.save();
+    emscripten_gb->save();
   }
 }
 #endif
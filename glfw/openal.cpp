@@ -1,11 +1,10 @@
 #include "openal.h"
-#include "core/gameboy.h"
 
 #include <stdint.h>
 #include <stdio.h>
-#include <math.h>
+#include <chrono>
 
-AudioOut::AudioOut(Audio &audio_) : audio(audio_)
+AudioOut::AudioOut()
 {
   dev = alcOpenDevice(NULL);
   if (!dev)
@@ -22,50 +21,95 @@ AudioOut::AudioOut(Audio &audio_) : audio(audio_)
     return;
   }
 
-  alGenBuffers(4, buffer);
-  alGenSources(4, source);
+  alGenBuffers(buffer_count, buffers);
+  alGenSources(1, &source);
   if (alGetError() != AL_NO_ERROR)
   {
     fprintf(stderr, "error generating buffers\n");
+    alcMakeContextCurrent(NULL);
+    alcDestroyContext(ctx);
+    ctx = nullptr;
     return;
   }
+
+  for (int i=0; i<buffer_count; i++)
+  {
+    free_buffers[free_count++] = buffers[i];
+  }
+
+#ifndef __EMSCRIPTEN__
+  // A chunk lasts over 10ms, so checking every couple of milliseconds keeps
+  // the source well fed
+  feeder = std::thread([this]()
+  {
+    while (!stopping)
+    {
+      update();
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  });
+#endif
 }
 
 AudioOut::~AudioOut()
 {
-  alDeleteSources(4, source);
-  alDeleteBuffers(4, buffer);
-  alcMakeContextCurrent(NULL);
-  alcDestroyContext(ctx);
-  alcCloseDevice(dev);
+  if (ctx)
+  {
+#ifndef __EMSCRIPTEN__
+    stopping = true;
+    feeder.join();
+#endif
+    alSourceStop(source);
+    alDeleteSources(1, &source);
+    alDeleteBuffers(buffer_count, buffers);
+    alcMakeContextCurrent(NULL);
+    alcDestroyContext(ctx);
+  }
+  if (dev)
+  {
+    alcCloseDevice(dev);
+  }
 }
 
-void AudioOut::play_channel(int channel, int freq)
+void AudioOut::write_samples(const s16 *samples, uint count)
 {
-  if (muted)
+  size_t buffered = ring.size();
+  if (buffered >= max_buffered)
     return;
-
-  if (debug)
-    printf("playing %d at %dhz\n", channel, freq);
-
-  stop_channel(channel);
-  alGenBuffers(1, &buffer[channel]);
-  alGenSources(1, &source[channel]);
-
-  alBufferData(buffer[channel], AL_FORMAT_MONO8, audio.get_channel(channel), 8, freq*8);
-
-  alSourcei(source[channel], AL_BUFFER, buffer[channel]);
-  alSourcei(source[channel], AL_LOOPING, AL_TRUE);
-
-  alSourcePlay(source[channel]);
+  if (count > max_buffered - buffered)
+    count = max_buffered - buffered;
+  ring.push(samples, count);
 }
 
-void AudioOut::stop_channel(int channel)
+void AudioOut::update()
 {
-  if (debug)
-    printf("stopppped %d\n", channel);
+  if (!ctx)
+    return;
+
+  ALint processed = 0;
+  alGetSourcei(source, AL_BUFFERS_PROCESSED, &processed);
+  while (processed-- > 0)
+  {
+    alSourceUnqueueBuffers(source, 1, &free_buffers[free_count++]);
+  }
+
+  // Only whole chunks are queued, so the source isn't handed lots of tiny
+  // buffers when the emulator writes a few samples at a time
+  while (free_count > 0 && ring.size() >= chunk_length)
+  {
+    ALuint buffer = free_buffers[--free_count];
+    ring.pop(chunk, chunk_length);
+    alBufferData(buffer, AL_FORMAT_MONO16, chunk, sizeof(chunk), sample_rate);
+    alSourceQueueBuffers(source, 1, &buffer);
+  }
 
-  alSourceStop(source[channel]);
-  alDeleteSources(1, &source[channel]);
-  alDeleteBuffers(1, &buffer[channel]);
+  // The source stops by itself when it runs out of samples
+  ALint state = AL_STOPPED;
+  alGetSourcei(source, AL_SOURCE_STATE, &state);
+  if (state != AL_PLAYING && free_count < buffer_count)
+  {
+    if (debug && state == AL_STOPPED)
+      printf("audio ran dry\n");
+    alSourcePlay(source);
+  }
 }
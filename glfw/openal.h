@@ -8,26 +8,56 @@
 #include <OpenAL/alc.h>
 #endif
 
-class Audio;
+#include <atomic>
+#include <thread>
 
-class AudioOut
+#include "core/audio.h"
+#include "core/spsc_queue.h"
+
+// Plays the emulator's samples through one streaming OpenAL source. Samples
+// wait in a lock free ring buffer until a whole chunk of them can be queued
+// on the source, which happens on a thread of its own natively, or through
+// update() from the main loop with Emscripten.
+class AudioOut final : public AudioOutput
 {
 public:
-  AudioOut() = delete;
-  explicit AudioOut(Audio &audio_);
+  AudioOut();
   ~AudioOut();
 
-  void play_channel(int channel, int freq);
+  bool is_open() const { return ctx != nullptr; }
 
-  void stop_channel(int channel);
+  uint get_sample_rate() const override { return sample_rate; }
+  void write_samples(const s16 *samples, uint count) override;
 
-  bool muted = false;
-  bool debug = false;
+  // Samples written but not yet queued on the source. Emulation is paced to
+  // keep this close to target_buffered.
+  size_t get_buffered() const { return ring.size(); }
+  static const size_t target_buffered = 1024;
 
-private:
-  Audio &audio;
+  // Queues any chunks ready to play, restarting the source if it ran dry
+  void update();
 
-  ALCdevice *dev;
-  ALCcontext *ctx;
-  ALuint source[4], buffer[4];
+private:
+  static const uint sample_rate = 48000;
+  static const uint chunk_length = 512;
+  static const int buffer_count = 4;
+
+  // Samples arriving when this far ahead, such as in turbo mode, are dropped
+  // rather than adding to the latency
+  static const size_t max_buffered = target_buffered * 2;
+
+  ALCdevice *dev = nullptr;
+  ALCcontext *ctx = nullptr;
+  ALuint source = 0;
+  ALuint buffers[buffer_count];
+  ALuint free_buffers[buffer_count];
+  int free_count = 0;
+
+  SPSCQueue<s16, 8192> ring;
+  s16 chunk[chunk_length];
+
+#ifndef __EMSCRIPTEN__
+  std::thread feeder;
+  std::atomic<bool> stopping{false};
+#endif
 };
@@ -1,8 +1,16 @@
 #include "core/gameboy.h"
 #include "core/display.h"
+#include "core/rewind.h"
+#include "core/spsc_queue.h"
+#include "openal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -21,6 +29,70 @@ void render();
 GLuint g_texture_loc;
 Gameboy *g_gb;
 
+// Number of frames to emulate per displayed frame while turbo is active.
+// 0 means emulate as many frames as fit into one display refresh.
+unsigned int g_turbo_speed;
+bool g_turbo = false;
+const double kRefreshTime = 1.0/60.0;
+
+// One Gameboy frame, a little longer than a 60Hz refresh
+const double kFrameTime = 70224.0/4194304.0;
+
+// Sound output, or null if there is none. While it's playing, the frame rate
+// is nudged by up to this much to keep pace with the audio device's clock.
+AudioOut *g_audio;
+const double kMaxRateAdjust = 0.005;
+
+// History of emulated frames, or null if rewinding is disabled
+Rewind *g_rewind;
+bool g_rewinding = false;
+
+// Key presses are queued up by the GLFW callbacks for whichever thread runs
+// the emulator
+struct Input
+{
+  enum class Type
+  {
+    BUTTON,
+    TURBO,
+    REWIND,
+  } type;
+  Joypad::Button::Name button;
+  bool pressed;
+};
+SPSCQueue<Input, 64> g_inputs;
+
+// Lines which have changed since the texture was last uploaded to
+Display::LineSet g_changed_lines = Display::LineSet().set();
+
+#ifndef __EMSCRIPTEN__
+// Natively, the emulator runs on a thread of its own, keeping time by
+// itself. Finished frames are queued up for the render thread, so waiting
+// for vsync or a slow compositor never holds up emulation or audio.
+struct Frame
+{
+  std::vector<u8> pixels;
+  Display::LineSet changed_lines;
+};
+SPSCQueue<Frame, 4> g_frames;
+std::atomic<bool> g_quit(false);
+#endif
+
+// Frames are streamed to the texture through a ring of slots in a pixel
+// buffer which stays mapped, so copying a frame in never waits for the GPU
+// to finish reading the last one. Without buffer storage, frames are
+// uploaded straight from the framebuffer.
+const unsigned int kPixelBufferSlots = 3;
+GLuint g_pixel_buffer;
+u8 *g_pixel_buffer_data;
+GLsync g_pixel_buffer_fences[kPixelBufferSlots];
+unsigned int g_pixel_buffer_slot;
+
+// Layout of the frames uploaded, taken before the emulation thread starts so
+// the render thread never has to ask the Gameboy
+unsigned int g_frame_pitch;
+size_t g_frame_size;
+
 GLuint compile_shader(GLenum type, const char* data) {
   GLuint shader = glCreateShader(type);
   glShaderSource(shader, 1, &data, NULL);
@@ -137,58 +209,290 @@ GLuint init_shaders() {
   return program;
 }
 
-void render()
+void handle_inputs()
+{
+  for (Input *input; (input = g_inputs.front()); g_inputs.pop())
+  {
+    switch (input->type)
+    {
+      case Input::Type::BUTTON:
+        input->pressed ? g_gb->button_pressed(input->button) :
+                         g_gb->button_released(input->button);
+        break;
+      case Input::Type::TURBO:
+        g_turbo = input->pressed;
+        break;
+      case Input::Type::REWIND:
+        g_rewinding = input->pressed;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void run_frame()
 {
   g_gb->run_to_vblank();
+  g_changed_lines |= g_gb->get_changed_lines();
+  if (g_rewind)
+    g_rewind->capture(*g_gb);
+}
+
+void run_frames()
+{
+  if (g_rewinding && g_rewind)
+  {
+    // Step back one frame per displayed frame, holding on the oldest frame
+    // once the history runs out
+    if (g_rewind->rewind(*g_gb))
+      g_changed_lines |= g_gb->get_changed_lines();
+  }
+  else if (!g_turbo)
+  {
+    run_frame();
+  }
+  else if (g_turbo_speed > 0)
+  {
+    for (unsigned int i=0; i<g_turbo_speed; i++)
+    {
+      run_frame();
+    }
+  }
+  else
+  {
+    double end_time = glfwGetTime() + kRefreshTime;
+    do
+    {
+      run_frame();
+    } while (glfwGetTime() < end_time);
+  }
+}
+
+#ifndef __EMSCRIPTEN__
+// How long until the next frame is due. With sound playing, frames come a
+// fraction faster while too few samples are waiting to be played, and a
+// fraction slower while too many are, so the sound neither runs dry nor
+// drifts behind the picture.
+double frame_time()
+{
+  if (!g_audio || g_turbo || g_rewinding)
+    return kFrameTime;
+
+  double target = AudioOut::target_buffered;
+  double error = (g_audio->get_buffered() - target) / target;
+  if (error > 1.0)
+    error = 1.0;
+  return kFrameTime * (1.0 + error * kMaxRateAdjust);
+}
+
+void emulation_loop()
+{
+  using Clock = std::chrono::steady_clock;
+  auto next_frame = Clock::now();
+
+  while (!g_quit)
+  {
+    handle_inputs();
+    run_frames();
+
+    // Only the last of the emulated frames is displayed. When the render
+    // thread is behind, frames are dropped and their changes carried over.
+    if (Frame *frame = g_frames.back())
+    {
+      frame->pixels.assign(g_gb->get_framebuffer(),
+                           g_gb->get_framebuffer() + g_gb->get_framebuffer_size());
+      frame->changed_lines = g_changed_lines;
+      g_frames.push();
+      g_changed_lines.reset();
+    }
+
+    // Keep to the Gameboy's frame rate by the clock, rather than the
+    // display's vsync. If emulation falls behind, carry on from now rather
+    // than rushing to catch up.
+    auto now = Clock::now();
+    next_frame += std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(frame_time()));
+    if (next_frame < now)
+    {
+      next_frame = now;
+    }
+    else
+    {
+      std::this_thread::sleep_until(next_frame);
+    }
+  }
+}
+#endif
+
+void init_texture()
+{
+  g_frame_pitch = g_gb->get_framebuffer_pitch();
+  g_frame_size = g_gb->get_framebuffer_size();
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+  // Storage is only allocated once, with frames written over it
+#ifndef __EMSCRIPTEN__
+  if (GLEW_ARB_texture_storage)
+  {
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, Display::width, Display::height);
+  }
+  else
+#endif
+  {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, Display::width, Display::height,
+        0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  }
+
+#ifndef __EMSCRIPTEN__
+  if (GLEW_ARB_buffer_storage)
+  {
+    GLsizeiptr size = g_frame_size * kPixelBufferSlots;
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &g_pixel_buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_pixel_buffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+    g_pixel_buffer_data = static_cast<u8 *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+#endif
+}
+
+void upload_frame(const u8 *frame, const Display::LineSet &changed_lines)
+{
+  if (changed_lines.none())
+  {
+    // The texture already holds this frame
+    return;
+  }
+
+  // Only the lines from the first to the last changed one are uploaded
+  unsigned int first = 0, last = Display::height - 1;
+  while (!changed_lines[first])
+    first++;
+  while (!changed_lines[last])
+    last--;
+
+  unsigned int pitch = g_frame_pitch;
+  size_t size = g_frame_size;
+  size_t offset = first * pitch;
+  size_t length = (last + 1 - first) * pitch;
+
+#ifndef __EMSCRIPTEN__
+  if (g_pixel_buffer_data)
+  {
+    // Wait for the GPU to finish with this slot's last frame, which it will
+    // have done long ago unless it's several frames behind
+    unsigned int slot = g_pixel_buffer_slot;
+    g_pixel_buffer_slot = (slot + 1) % kPixelBufferSlots;
+    if (g_pixel_buffer_fences[slot])
+    {
+      glClientWaitSync(g_pixel_buffer_fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+      glDeleteSync(g_pixel_buffer_fences[slot]);
+    }
+
+    memcpy(g_pixel_buffer_data + slot*size + offset, frame + offset, length);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_pixel_buffer);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, Display::width, last + 1 - first,
+        GL_RGBA, GL_UNSIGNED_BYTE, reinterpret_cast<const GLvoid *>(slot*size + offset));
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    g_pixel_buffer_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    return;
+  }
+#endif
+
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, Display::width, last + 1 - first,
+      GL_RGBA, GL_UNSIGNED_BYTE, frame + offset);
+}
+
+#ifndef __EMSCRIPTEN__
+// The frame on display, which the render thread keeps hold of by swapping
+// buffers with the queue
+std::vector<u8> g_displayed_pixels;
+
+void render()
+{
+  Display::LineSet changed_lines;
+  for (Frame *frame; (frame = g_frames.front()); g_frames.pop())
+  {
+    g_displayed_pixels.swap(frame->pixels);
+    changed_lines |= frame->changed_lines;
+  }
 
   glClear(GL_COLOR_BUFFER_BIT);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, Display::width, Display::height,
-      0, GL_RGB, GL_UNSIGNED_BYTE, g_gb->get_framebuffer());
+  upload_frame(g_displayed_pixels.data(), changed_lines);
   glUniform1i(g_texture_loc, 0);
   glDrawArrays(GL_TRIANGLES, 0, 6);
 }
+#else
+void render()
+{
+  handle_inputs();
+  run_frames();
+  if (g_audio)
+    g_audio->update();
+
+  glClear(GL_COLOR_BUFFER_BIT);
+  upload_frame(g_gb->get_framebuffer(), g_changed_lines);
+  g_changed_lines.reset();
+  glUniform1i(g_texture_loc, 0);
+  glDrawArrays(GL_TRIANGLES, 0, 6);
+}
+#endif
 
-void key_callback(GLFWwindow *window, int key, int /*scancode*/, int action, int /*mode*/)
+void key_callback(GLFWwindow * /*window*/, int key, int /*scancode*/, int action, int /*mode*/)
 {
-  Gameboy *gb = (Gameboy *)glfwGetWindowUserPointer(window);
-  bool pressed = (action != GLFW_RELEASE);
+  if (action == GLFW_REPEAT)
+    return;
+
+  Input input;
+  input.type = Input::Type::BUTTON;
+  input.pressed = (action == GLFW_PRESS);
   switch (key)
   {
     case GLFW_KEY_UP:
-      pressed ? gb->button_pressed(Joypad::Button::UP) :
-                gb->button_released(Joypad::Button::UP);
+      input.button = Joypad::Button::UP;
       break;
     case GLFW_KEY_DOWN:
-      pressed ? gb->button_pressed(Joypad::Button::DOWN) :
-                gb->button_released(Joypad::Button::DOWN);
+      input.button = Joypad::Button::DOWN;
       break;
     case GLFW_KEY_LEFT:
-      pressed ? gb->button_pressed(Joypad::Button::LEFT) :
-                gb->button_released(Joypad::Button::LEFT);
+      input.button = Joypad::Button::LEFT;
       break;
     case GLFW_KEY_RIGHT:
-      pressed ? gb->button_pressed(Joypad::Button::RIGHT) :
-                gb->button_released(Joypad::Button::RIGHT);
+      input.button = Joypad::Button::RIGHT;
       break;
     case GLFW_KEY_Z:
-      pressed ? gb->button_pressed(Joypad::Button::A) :
-                gb->button_released(Joypad::Button::A);
+      input.button = Joypad::Button::A;
       break;
     case GLFW_KEY_X:
-      pressed ? gb->button_pressed(Joypad::Button::B) :
-                gb->button_released(Joypad::Button::B);
+      input.button = Joypad::Button::B;
       break;
     case GLFW_KEY_ENTER:
-      pressed ? gb->button_pressed(Joypad::Button::START) :
-                gb->button_released(Joypad::Button::START);
+      input.button = Joypad::Button::START;
       break;
     case GLFW_KEY_BACKSPACE:
-      pressed ? gb->button_pressed(Joypad::Button::SELECT) :
-                gb->button_released(Joypad::Button::SELECT);
+      input.button = Joypad::Button::SELECT;
       break;
-    default:
+    case GLFW_KEY_TAB:
+      input.type = Input::Type::TURBO;
       break;
+    case GLFW_KEY_R:
+      input.type = Input::Type::REWIND;
+      break;
+    default:
+      return;
   }
+
+  // Should the emulator somehow fall that far behind, the key is dropped
+  g_inputs.push(input);
 }
 
 void window_size_callback(GLFWwindow * /*window*/, int width, int height)
@@ -218,15 +522,19 @@ void window_size_callback(GLFWwindow * /*window*/, int width, int height)
 
 }  // namespace
 
-void render_loop(Gameboy &gb)
+void render_loop(Gameboy &gb, unsigned int turbo_speed, Rewind *rewind, AudioOut *audio)
 {
   g_gb = &gb;
+  g_audio = audio;
+  // Whole 4 byte pixels are the cheapest for GL to upload
+  g_gb->set_pixel_format(Display::PixelFormat::RGBA8888);
+  g_turbo_speed = turbo_speed;
+  g_rewind = rewind;
 
   const unsigned int width = Display::width * 5;
   const unsigned int height = Display::height * 5;
 
   GLFWwindow *window = initgl(width, height);
-  glfwSetWindowUserPointer(window, &gb);
 
   GLuint program = init_shaders();
 
@@ -261,15 +569,8 @@ void render_loop(Gameboy &gb)
   //
   // Texture
   //
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
   glActiveTexture(GL_TEXTURE0);
+  init_texture();
 
   // Uncomment to change display FPS
   //  glfwSwapInterval(0);
@@ -277,6 +578,7 @@ void render_loop(Gameboy &gb)
 #ifdef __EMSCRIPTEN__
   emscripten_set_main_loop(render, 0, 1);
 #else
+  std::thread emulator(emulation_loop);
   while (!glfwWindowShouldClose(window))
   {
     render();
@@ -284,5 +586,7 @@ void render_loop(Gameboy &gb)
     glfwSwapBuffers(window);
     glfwPollEvents();
   }
+  g_quit = true;
+  emulator.join();
 #endif
 }
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "core/gameboy.h"
+
+static char *name;
+static std::string ram_file;
+
+void save_ram(void *ram, unsigned int size)
+{
+  std::ofstream out(ram_file);
+  out.write(reinterpret_cast<char *>(ram), size);
+}
+
+void usage()
+{
+  printf("Usage: %s [options] rom\n", name);
+  printf("Options:\n");
+  printf("  -n frames             Number of frames to run before exiting (default: run forever)\n");
+  printf("  -o file               Load and save game RAM using this file (default: don't save)\n");
+  printf("  -s                    Keep game RAM memory mapped from the -o file, written out in\n");
+  printf("                        the background\n");
+  printf("  -v [original|colour]  Select version of Gameboy to emulate\n");
+}
+
+int main(int argc, char *argv[])
+{
+  name = argv[0];
+  if (argc < 2)
+  {
+    usage();
+    return 1;
+  }
+
+  Gameboy gb;
+  unsigned long frames = 0;
+  bool ram_file_set = false;
+  bool map_save_file = false;
+  int c;
+  while ((c = getopt(argc, argv, "n:o:sv:")) != -1)
+  {
+    switch (c)
+    {
+      case 'n':
+      {
+        char *end;
+        frames = strtoul(optarg, &end, 10);
+        if (*end != '\0')
+        {
+          fprintf(stderr, "Invalid number of frames: '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      }
+      case 'o':
+        ram_file = optarg;
+        ram_file_set = true;
+        break;
+      case 's':
+        map_save_file = true;
+        break;
+      case 'v':
+      {
+        std::string arg = optarg;
+        if (arg == "original")
+        {
+          gb.set_version(Gameboy::GB_VERSION::ORIGINAL);
+        }
+        else if (arg == "colour")
+        {
+          gb.set_version(Gameboy::GB_VERSION::COLOUR);
+        }
+        else
+        {
+          fprintf(stderr, "Invalid Gameboy version: '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      }
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  // There should only be 1 non-option argument (the rom file)
+  if (optind != argc-1)
+  {
+    usage();
+    return 1;
+  }
+
+  char *rom_file = argv[optind];
+
+  std::ifstream rom(rom_file);
+  if (!rom.is_open())
+  {
+    fprintf(stderr, "Couldn't load ROM from '%s'\n", rom_file);
+    return 1;
+  }
+
+  if (ram_file_set)
+  {
+    std::ifstream ram(ram_file);
+    gb.load_rom(rom, ram);
+    if (map_save_file && !gb.map_save_file(ram_file))
+    {
+      fprintf(stderr, "Couldn't map save file '%s', saving it normally\n", ram_file.c_str());
+      map_save_file = false;
+    }
+    if (!map_save_file)
+    {
+      gb.set_save_callback(&save_ram);
+    }
+  }
+  else
+  {
+    // Start with blank cartridge RAM and never write it back out
+    std::istringstream ram;
+    gb.load_rom(rom, ram);
+  }
+  rom.close();
+
+  auto start = std::chrono::steady_clock::now();
+
+  unsigned long frame;
+  for (frame = 0; frames == 0 || frame < frames; frame++)
+  {
+    gb.run_to_vblank();
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  printf("Ran %lu frames in %.3f seconds (%.1f frames/s)\n",
+         frame, seconds, frame / seconds);
+
+  return 0;
+}
@@ -203,7 +203,8 @@ class Graphics2DInstance : public pp::Instance {
 
     uint32_t num_pixels = Display::width * Display::height;
 
-    const Display::Colour *framebuffer = gb_.get_framebuffer();
+    const Display::Colour *framebuffer =
+        reinterpret_cast<const Display::Colour *>(gb_.get_framebuffer());
     for (unsigned int i = 0; i < num_pixels; ++i) {
       data[i] = 0xff000000 | (framebuffer[i].r << 16) | (framebuffer[i].g << 8) | (framebuffer[i].b);
     }